@@ -0,0 +1,194 @@
+#!/bin/sh
+# Regression checks run by make check: combine the edge case corpus written by
+# massif-gen -e in every mode and compare the outputs with bench/edge.sha256.
+# Usage: bench/check.sh <edge-dir>, or bench/check.sh -u <edge-dir> to rewrite the digests
+set -e
+
+update=
+if [ "$1" = "-u" ]; then
+  update=1
+  shift
+fi
+dir=${1:-bench/edge}
+digests=$(pwd)/bench/edge.sha256
+combine=$(pwd)/massif-combine
+out=$dir/out
+
+rm -rf "$out"
+mkdir -p "$out"
+
+# Each input alone, then all of them in every mode that must not change the output
+for input in "$dir"/massif.vgdb.*; do
+  name=$(basename "$input")
+  "$combine" -o "$out/${name#massif.vgdb.}.out" "$input" 2>>"$out/check.log"
+done
+all="$dir/massif.vgdb.*"
+"$combine" -o "$out/all.out" "$all" 2>>"$out/check.log"
+"$combine" -o "$out/all-j4.out" -j 4 "$all" 2>>"$out/check.log"
+"$combine" -o "$out/all-s.out" -s "$all" 2>>"$out/check.log"
+"$combine" -o "$out/all-s-j4.out" -s -j 4 "$all" 2>>"$out/check.log"
+"$combine" -o "$out/all-passthrough.out" --passthrough "$all" 2>>"$out/check.log"
+"$combine" -o "$out/all-passthrough-j4.out" --passthrough -j 4 "$all" 2>>"$out/check.log"
+"$combine" -o "$out/all-io-uring.out" --io-uring --passthrough "$all" 2>>"$out/check.log"
+"$combine" -o "$out/all-io-uring-j4.out" --io-uring --passthrough -j 4 "$all" 2>>"$out/check.log"
+"$combine" -o "$out/all-dedup.out" --dedup "$all" 2>>"$out/check.log"
+"$combine" -o "$out/all-window.out" --from=1000 --to=500000 "$all" 2>>"$out/check.log"
+"$combine" -o "$out/all-aggregate.out" --tree=aggregate "$all" 2>>"$out/check.log"
+"$combine" -o "$out/all-delta.out" --tree=delta:2000:0 "$all" 2>>"$out/check.log"
+if grep -q '=-\|^ *n[0-9]*: -' "$out/all-delta.out"; then
+  echo "Error: the delta tree has negative massif sizes" >&2
+  exit 1
+fi
+# Nor a node smaller than its children together, or a mem_heap_B smaller than its tree
+for tree in all-aggregate all-delta; do
+  if ! awk '
+    function pop(depth) {
+      for (; top > 0 && level[top] >= depth; top--) if (below[top] > size[top]) bad++
+    }
+    /^mem_heap_B=/ { heap = substr($0, 12) + 0 }
+    /^ *n[0-9]*: / {
+      match($0, /^ */)
+      pop(RLENGTH)
+      if (top > 0) below[top] += $2; else roots += $2
+      top++; level[top] = RLENGTH; size[top] = $2 + 0; below[top] = 0
+      next
+    }
+    { pop(0); if (roots > heap) bad++; roots = 0 }
+    END { pop(0); if (roots > heap) bad++; exit bad > 0 }' "$out/$tree.out"; then
+    echo "Error: $tree.out has a node smaller than its children" >&2
+    exit 1
+  fi
+done
+"$combine" --summary=json "$all" >"$out/summary.out" 2>>"$out/check.log"
+"$combine" --summary=json --dedup "$all" >"$out/summary-dedup.out" 2>>"$out/check.log"
+
+# Snapshots in the layout valgrind writes them, two detailed_snapshot files and an
+# all_snapshots one taken between them: bench/capture/combined was put together by hand
+for mode in "" "-s -j 4"; do
+  "$combine" -o "$out/capture.tmp" $mode 'bench/capture/massif.vgdb.*' 2>>"$out/check.log"
+  if ! cmp -s bench/capture/combined "$out/capture.tmp"; then
+    echo "Error: combining bench/capture ${mode:+with $mode }differs from bench/capture/combined" >&2
+    exit 1
+  fi
+done
+rm -f "$out/capture.tmp"
+
+# Appending older snapshots through a window merges them with all the existing ones
+cp "$out/10-chunked.out" "$out/append-window.out"
+"$combine" -o "$out/append-window.out" --append --to=3000 "$dir"/massif.vgdb.*-eof-no-newline 2>>"$out/check.log"
+before=$(grep -c '^snapshot=' "$out/10-chunked.out")
+after=$(grep -c '^snapshot=' "$out/append-window.out")
+if [ "$after" -ne $((before + 2)) ]; then
+  echo "Error: appending 2 snapshots to $before left $after" >&2
+  exit 1
+fi
+
+# A combined output combined again is copied in runs of snapshots, it must come out the same
+"$combine" -o "$out/indexed.out" --index "$dir"/massif.vgdb.*-chunked 2>>"$out/check.log"
+"$combine" -o "$out/again.out" --index --passthrough -j 4 "$out/indexed.out" 2>>"$out/check.log"
+if ! cmp -s "$out/indexed.out" "$out/again.out" || ! cmp -s "$out/indexed.out.idx" "$out/again.out.idx"; then
+  echo "Error: combining a combined output again changed it or its index" >&2
+  exit 1
+fi
+
+# Appending with --index to an output without an index builds it quietly, as a write would
+"$combine" -o "$out/unindexed.tmp" "$dir"/massif.vgdb.*-chunked 2>>"$out/check.log"
+"$combine" -o "$out/unindexed.tmp" --append --index "$dir"/massif.vgdb.*-eof-no-newline 2>"$out/unindexed.log"
+"$combine" -o "$out/reindexed.tmp" --index "$dir"/massif.vgdb.*-chunked "$dir"/massif.vgdb.*-eof-no-newline 2>>"$out/check.log"
+if [ -s "$out/unindexed.log" ] || ! cmp -s "$out/unindexed.tmp.idx" "$out/reindexed.tmp.idx"; then
+  echo "Error: appending to an output without an index warned or wrote another index" >&2
+  exit 1
+fi
+
+# The large input is parsed in more than one chunk with jobs to spare, in one without
+chunks() {
+  "$combine" -o "$out/chunks.tmp" --stats=json "$@" "$dir"/massif.vgdb.*-chunked 2>>"$out/check.log" |
+    sed -n 's/.*"chunks": \([0-9]*\).*/\1/p'
+}
+serial=$(chunks)
+parallel=$(chunks -j 4)
+rm -f "$out/chunks.tmp"
+if [ "$serial" != 1 ] || [ "${parallel:-0}" -le 1 ]; then
+  echo "Error: the chunked input was parsed in $serial chunks serially, ${parallel:-no} chunks with -j 4" >&2
+  exit 1
+fi
+
+# A watched output matching the patterns is not combined again as it is written
+mkdir -p "$out/watch"
+cp "$dir"/massif.vgdb.*-chunked "$out/watch/massif.vgdb.1"
+"$combine" -o "$out/watch/massif.vgdb.out" --watch="$out/watch" 'massif.vgdb.*' 2>>"$out/check.log" &
+watcher=$!
+sleep 1
+cp "$dir"/massif.vgdb.*-eof-no-newline "$out/watch/massif.vgdb.2"
+sleep 1
+kill -TERM $watcher
+wait $watcher
+expected=$(cat "$out/watch/massif.vgdb.1" "$out/watch/massif.vgdb.2" | grep -c '^snapshot=')
+watched=$(grep -c '^snapshot=' "$out/watch/massif.vgdb.out")
+if [ "$watched" -ne "$expected" ]; then
+  echo "Error: watching the directory of the output left $watched snapshots in it, not $expected" >&2
+  exit 1
+fi
+
+# Gzip inputs are decompressed a block at a time with -s, by the summary and to append,
+# blocks end anywhere in a line: the outputs must be the ones of the inputs as is.
+# Skipped when built without zlib
+same() {
+  if ! cmp -s "$1" "$2"; then
+    echo "Error: $2 from gzip files differs from $1" >&2
+    exit 1
+  fi
+}
+if "$combine" -o "$out/gzip.tmp" bench/corpus/minimal.gz 2>>"$out/check.log" && [ -s "$out/gzip.tmp" ]; then
+  mkdir -p "$out/gz"
+  for input in "$dir"/massif.vgdb.*; do
+    gzip -c "$input" >"$out/gz/$(basename "$input").gz"
+  done
+  gzipped="$out/gz/massif.vgdb.*"
+  "$combine" -o "$out/gz/all-s.tmp" -s "$gzipped" 2>>"$out/check.log"
+  same "$out/all-s.out" "$out/gz/all-s.tmp"
+  "$combine" -o "$out/gz/all-s-j4.tmp" -s -j 4 "$gzipped" 2>>"$out/check.log"
+  same "$out/all-s-j4.out" "$out/gz/all-s-j4.tmp"
+  "$combine" --summary=json "$gzipped" >"$out/gz/summary.tmp" 2>>"$out/check.log"
+  same "$out/summary.out" "$out/gz/summary.tmp"
+  # A tree scan resumed inside a line still writes the same snapshots, not the same lines
+  lines() {
+    "$combine" -o "$out/gz/lines.tmp" -s --stats=json "$1" 2>>"$out/check.log" |
+      sed -n 's/.*\("lines": {[^}]*}\).*/\1/p'
+  }
+  if [ "$(lines "$all")" != "$(lines "$gzipped")" ]; then
+    echo "Error: the gzip files read as $(lines "$gzipped"), not $(lines "$all")" >&2
+    exit 1
+  fi
+  # Without heap trees every line goes through the state machine, at the block ends too
+  i=0
+  while [ $i -lt 64 ]; do
+    grep -v '^[ n]' "$dir"/massif.vgdb.*-chunked
+    i=$((i + 1))
+  done >"$out/gz/no-trees"
+  gzip -c "$out/gz/no-trees" >"$out/gz/no-trees.gz"
+  "$combine" -o "$out/gz/no-trees.tmp" -s "$out/gz/no-trees" 2>>"$out/check.log"
+  "$combine" -o "$out/gz/no-trees-gz.tmp" -s "$out/gz/no-trees.gz" 2>>"$out/check.log"
+  same "$out/gz/no-trees.tmp" "$out/gz/no-trees-gz.tmp"
+
+  # Appended after the last snapshot of the output, then merged with it
+  awk '/^time=/ { printf "time=%d\n", substr($0, 6) + 2000000; next } { print }' \
+    "$dir"/massif.vgdb.*-eof-no-newline >"$out/gz/late"
+  for input in "$out/gz/late" "$dir"/massif.vgdb.*-eof-no-newline; do
+    cp "$out/10-chunked.out" "$out/gz/append.tmp"
+    gzip -c "$out/10-chunked.out" >"$out/gz/append.tmp.gz"
+    "$combine" -o "$out/gz/append.tmp" --append "$input" 2>>"$out/check.log"
+    "$combine" -o "$out/gz/append.tmp.gz" --append "$input" 2>>"$out/check.log"
+    gzip -dc "$out/gz/append.tmp.gz" >"$out/gz/append-gz.tmp"
+    same "$out/gz/append.tmp" "$out/gz/append-gz.tmp"
+  done
+fi
+rm -f "$out/gzip.tmp"
+
+if [ -n "$update" ]; then
+  (cd "$dir" && sha256sum massif.vgdb.* out/*.out) > "$digests"
+  echo "Updated $digests"
+  exit 0
+fi
+(cd "$dir" && sha256sum --quiet -c "$digests")
+echo "Edge case outputs match $digests"
@@ -0,0 +1,284 @@
+// Measure MassifFile::add and MassifFile::write, prints one JSON object
+#include "../src/massif-internal.h"
+
+#include <fstream>
+
+void benchUsage(const char *app) {
+  std::cout << "Usage: " << app << " [-o output] [-j jobs] [-r runs] [-s] [-S] [-c] [-b baseline] [-l loss] <file-pattern>..." << std::endl;
+  std::cout << "\t\t-o output: combined file, default bench/massif.out.bench" << std::endl;
+  std::cout << "\t\t-j jobs: number of threads parsing input files, default 1" << std::endl;
+  std::cout << "\t\t-r runs: report the fastest of this many runs, default 1, or 3 with -b" << std::endl;
+  std::cout << "\t\t-s: measure the streaming merge instead of add and write" << std::endl;
+  std::cout << "\t\t-S: measure the raw line scan throughput of each tree scanner instead" << std::endl;
+  std::cout << "\t\t-c: check every way of combining writes the same output instead" << std::endl;
+  std::cout << "\t\t-b baseline: fail when the output or mb_per_s regress from this result, saved there when missing" << std::endl;
+  std::cout << "\t\t-l loss: percent of mb_per_s the baseline gate tolerates losing, default 10" << std::endl;
+}
+
+// Hash of a whole output file, 0 when it is missing
+static uint64_t digestFile(const std::string &path) {
+  MappedFile file;
+  if (file.open(path) != 0) return 0;
+  return hashBytes(file.data(), file.size());
+}
+
+// Combine files every way the output must not depend on, each digest must match the serial add and write
+static int benchCheck(const std::vector<std::string> &files, const std::string &output, unsigned jobs) {
+  typedef struct {
+    const char *name;
+    bool streaming;
+    bool passthrough;
+    bool largest;  // only the largest input, its chunks parsed by several threads
+    unsigned jobs;
+  } CheckMode;
+  std::vector<CheckMode> modes = {
+    {"add+write", false, false, false, 1}, {"add+write", false, false, false, jobs},
+    {"add+write passthrough", false, true, false, jobs}, {"stream", true, false, false, 1},
+    {"stream", true, false, false, jobs}, {"largest", false, false, true, 1}, {"largest", false, false, true, jobs},
+  };
+
+  std::vector<std::string> largest(1);
+  uint64_t largestSize = 0;
+  for (auto &file : files) {
+    struct stat buf;
+    if (stat(file.c_str(), &buf) == 0 && (uint64_t)buf.st_size >= largestSize) {
+      largestSize = buf.st_size;
+      largest[0] = file;
+    }
+  }
+
+  uint64_t expected[2] = {0, 0};
+  bool failed = false;
+  printf("{\"mode\": \"check\", \"files\": %zu, \"results\": {", files.size());
+  for (size_t i = 0; i < modes.size(); i++) {
+    const std::vector<std::string> &inputs = modes[i].largest ? largest : files;
+    MassifFile massifFile;
+    massifFile.setPassthrough(modes[i].passthrough);
+    unlink(output.c_str());
+    int ret;
+    if (modes[i].streaming) {
+      ret = massifFile.stream(inputs, output, modes[i].jobs);
+    } else {
+      massifFile.add(inputs, modes[i].jobs);
+      ret = massifFile.write(output);
+    }
+    uint64_t digest = ret == 0 ? digestFile(output) : 0;
+    if (modes[i].jobs == 1 && !modes[i].streaming) expected[modes[i].largest] = digest;
+    if (digest != expected[modes[i].largest]) {
+      std::cerr << "Error: " << modes[i].name << " -j " << modes[i].jobs << " wrote a different output" << std::endl;
+      failed = true;
+    }
+    printf("%s\"%s -j%u\": \"%016llx\"", i > 0 ? ", " : "", modes[i].name, modes[i].jobs, (unsigned long long)digest);
+  }
+  printf("}, \"match\": %s}\n", failed ? "false" : "true");
+  return failed ? 1 : 0;
+}
+
+// Number after "key": in a result line, or -1
+static double resultNumber(const std::string &result, const char *key) {
+  size_t found = result.find(std::string("\"") + key + "\": ");
+  if (found == std::string::npos) return -1;
+  return atof(result.c_str() + found + strlen(key) + 4);
+}
+
+// String after "key": in a result line
+static std::string resultString(const std::string &result, const char *key) {
+  size_t found = result.find(std::string("\"") + key + "\": \"");
+  if (found == std::string::npos) return "";
+  size_t begin = found + strlen(key) + 5;
+  return result.substr(begin, result.find('"', begin) - begin);
+}
+
+// Compare a result with the baseline from an earlier run on the same inputs, save it when there is none
+static int gateBaseline(const std::string &path, const std::string &result, double loss) {
+  std::ifstream in(path);
+  std::string baseline;
+  if (!in || !std::getline(in, baseline)) {
+    std::ofstream out(path);
+    out << result;
+    std::cerr << "WARN: no baseline in " << path << ", saved this run" << std::endl;
+    return out ? 0 : 1;
+  }
+  if (resultNumber(baseline, "input_bytes") != resultNumber(result, "input_bytes") ||
+      resultNumber(baseline, "jobs") != resultNumber(result, "jobs") ||
+      resultString(baseline, "mode") != resultString(result, "mode")) {
+    std::cerr << "WARN: " << path << " was measured on other inputs or another mode, not compared" << std::endl;
+    return 0;
+  }
+
+  int ret = 0;
+  if (resultString(baseline, "digest") != resultString(result, "digest")) {
+    std::cerr << "Error: output digest " << resultString(result, "digest") << " differs from baseline "
+              << resultString(baseline, "digest") << std::endl;
+    ret = 2;
+  }
+  double before = resultNumber(baseline, "mb_per_s"), after = resultNumber(result, "mb_per_s");
+  if (after < before * (1 - loss / 100)) {
+    std::cerr << "Error: " << after << " MB/s is more than " << loss << "% below baseline " << before << " MB/s" << std::endl;
+    ret = 2;
+  }
+  return ret;
+}
+
+// Split the mapped inputs into lines with scan, the lines ending a tree take a memchr
+static double scanFiles(const std::vector<std::unique_ptr<MappedFile>> &inputs, TreeScan scan, uint64_t &lines) {
+  Clock::time_point start = Clock::now();
+  lines = 0;
+  for (auto &input : inputs) {
+    const char *data = input->data();
+    size_t size = input->size(), offset = 0;
+    while ((offset = scan(data, offset, size, lines)) < size) {
+      const char *eol = static_cast<const char *>(memchr(data + offset, '\n', size - offset));
+      offset = eol == nullptr ? size : eol - data + 1;
+      lines++;
+    }
+  }
+  return secondsSince(start);
+}
+
+// Print the best of a few runs of each scanner, all of them must agree on the lines
+static int benchScan(const std::vector<std::string> &files) {
+  std::vector<std::unique_ptr<MappedFile>> inputs;
+  uint64_t bytes = 0, lines = 0;
+  for (auto &file : files) {
+    std::unique_ptr<MappedFile> input(new MappedFile());
+    if (input->open(file) != 0) continue;
+    bytes += input->size();
+    inputs.push_back(std::move(input));
+  }
+  scanFiles(inputs, scanTreeScalar, lines); // fault the pages in
+
+  std::vector<std::pair<const char *, TreeScan>> scanners = {{"scalar", scanTreeScalar}};
+#if defined(__x86_64__)
+  scanners.push_back({"sse2", scanTreeSse2});
+  if (__builtin_cpu_supports("avx2")) scanners.push_back({"avx2", scanTreeAvx2});
+#endif
+
+  const char *selected;
+  selectTreeScan(&selected);
+  printf("{\"mode\": \"scan\", \"files\": %zu, \"input_bytes\": %llu, \"lines\": %llu, \"selected\": \"%s\", \"gb_per_s\": {",
+         inputs.size(), (unsigned long long)bytes, (unsigned long long)lines, selected);
+  for (size_t i = 0; i < scanners.size(); i++) {
+    double best = 0;
+    for (int run = 0; run < 5; run++) {
+      uint64_t count;
+      double time = scanFiles(inputs, scanners[i].second, count);
+      if (count != lines) {
+        std::cerr << "Error: " << scanners[i].first << " found " << count << " lines instead of " << lines << std::endl;
+        return 1;
+      }
+      if (run == 0 || time < best) best = time;
+    }
+    printf("%s\"%s\": %.2f", i > 0 ? ", " : "", scanners[i].first, bytes / 1e9 / best);
+  }
+  printf("}}\n");
+  return 0;
+}
+
+int main(int argc, char * const* argv) {
+  std::string output = "bench/massif.out.bench";
+  unsigned jobs = 1;
+  bool streaming = false, scanning = false, checking = false;
+  std::string baseline;
+  double loss = 10;
+  unsigned runs = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:j:r:sScb:l:")) != -1) {
+    switch (opt) {
+    case 'o': output = optarg; break;
+    case 'j': jobs = std::max(1, atoi(optarg)); break;
+    case 'r': runs = std::max(1, atoi(optarg)); break;
+    case 's': streaming = true; break;
+    case 'S': scanning = true; break;
+    case 'c': checking = true; break;
+    case 'b': baseline = optarg; break;
+    case 'l': loss = atof(optarg); break;
+    default:
+      benchUsage(argv[0]);
+      return -1;
+    }
+  }
+
+  Clock::time_point start = Clock::now();
+  std::vector<std::string> files;
+  for (int i = optind; i < argc; i++) {
+    if (fileExists(argv[i])) {
+      files.push_back(argv[i]);
+    } else {
+      listFile(files, argv[i]);
+    }
+  }
+  double listTime = secondsSince(start);
+  if (files.empty()) {
+    benchUsage(argv[0]);
+    return -1;
+  }
+
+  if (scanning) {
+    return benchScan(files);
+  }
+  if (checking) {
+    return benchCheck(files, output, std::max(2u, jobs));
+  }
+  if (runs == 0) {
+    runs = baseline.empty() ? 1 : 3;
+  }
+
+  uint64_t bytes = 0;
+  for (auto &file : files) {
+    struct stat buf;
+    if (stat(file.c_str(), &buf) == 0) bytes += buf.st_size;
+  }
+
+  // Keep the fastest run, each one writes a fresh output
+  double addTime = 0, writeTime = 0;
+  size_t snapshots = 0;
+  for (unsigned run = 0; run < runs; run++) {
+    MassifFile massifFile;
+    double add = 0, write;
+    int ret;
+    unlink(output.c_str());
+    start = Clock::now();
+    if (streaming) {
+      ret = massifFile.stream(files, output, jobs);
+      write = secondsSince(start);
+    } else {
+      massifFile.add(files, jobs);
+      add = secondsSince(start);
+      start = Clock::now();
+      ret = massifFile.write(output);
+      write = secondsSince(start);
+    }
+    if (ret != 0) {
+      std::cerr << "Error writing " << output << std::endl;
+      return 1;
+    }
+    if (run == 0 || add + write < addTime + writeTime) {
+      addTime = add;
+      writeTime = write;
+    }
+    snapshots = massifFile.snapshots().size();
+  }
+
+  struct stat buf;
+  uint64_t outputBytes = stat(output.c_str(), &buf) == 0 ? buf.st_size : 0;
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  double total = addTime + writeTime;
+  char result[1024];
+  snprintf(result, sizeof(result),
+           "{\"mode\": \"%s\", \"jobs\": %u, \"files\": %zu, \"input_bytes\": %llu, \"output_bytes\": %llu, "
+           "\"snapshots\": %s, \"digest\": \"%016llx\", \"phases\": {\"list_s\": %.6f, \"add_s\": %.6f, \"write_s\": %.6f}, "
+           "\"files_per_s\": %.1f, \"mb_per_s\": %.1f, \"peak_rss_kb\": %ld}\n",
+           streaming ? "stream" : "add+write", jobs, files.size(),
+           (unsigned long long)bytes, (unsigned long long)outputBytes,
+           streaming ? "null" : std::to_string(snapshots).c_str(),
+           (unsigned long long)digestFile(output), listTime, addTime, writeTime,
+           files.size() / total, bytes / 1e6 / total, usage.ru_maxrss);
+  fputs(result, stdout);
+  if (!baseline.empty()) {
+    return gateBaseline(baseline, result, loss);
+  }
+  return 0;
+}
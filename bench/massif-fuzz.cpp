@@ -0,0 +1,195 @@
+// Fuzz target of the snapshot parser: an input must read the same whole, split on its
+// snapshot starts, and with every heap tree scanner. Built with gcc it replays a corpus,
+// with clang -fsanitize=fuzzer -DMASSIF_LIBFUZZER libFuzzer drives it
+#include "../src/massif-internal.h"
+
+#include <fstream>
+
+#include <dirent.h>
+
+// Lines of inputs up to this size are each scanned by every tree scanner
+static const size_t SCAN_BYTES = 1 << 20;
+
+typedef struct {
+  std::vector<Snapshot> snapshots;
+  StringList headers;
+  int result;
+  size_t started;
+  size_t titleBase;
+  bool resumable;
+} ReadResult;
+
+// Read the snapshots of a range like parseFile reads one chunk
+static ReadResult readRange(const MappedFile &file, size_t begin, size_t end) {
+  SnapshotReader reader;
+  reader.openRange(file, begin, end, true, true);
+  ReadResult read;
+  Snapshot snapshot;
+  while (reader.next(snapshot)) {
+    read.snapshots.push_back(snapshot);
+  }
+  read.headers = std::move(reader.headers);
+  read.result = reader.result();
+  read.started = reader.started();
+  read.titleBase = reader.titleBase();
+  read.resumable = reader.resumable();
+  return read;
+}
+
+static bool sameSnapshot(const Snapshot &a, const Snapshot &b) {
+  return a.time == b.time && a.memHeap == b.memHeap && a.memHeapExtra == b.memHeapExtra && a.memStacks == b.memStacks &&
+         a.offset == b.offset && a.length == b.length && a.index == b.index && a.hash == b.hash && a.heapTree == b.heapTree &&
+         a.flags == b.flags;
+}
+
+static void fail(const char *what, size_t offset) {
+  std::cerr << "Error: " << what << " at " << offset << std::endl;
+  abort();
+}
+
+// Line of data at offset, without its newline
+static std::string lineAt(const char *data, size_t size, size_t offset) {
+  const char *eol = static_cast<const char *>(memchr(data + offset, '\n', size - offset));
+  return std::string(data + offset, (eol == nullptr ? data + size : eol) - data - offset);
+}
+
+// findSnapshotStart one line at a time: the mark, name and mark lines after a newline at or after from
+static size_t naiveSnapshotStart(const char *data, size_t size, size_t from) {
+  for (size_t i = from; i < size; i++) {
+    if (data[i] != '\n') continue;
+    size_t mark = i + 1;
+    std::string first = lineAt(data, size, std::min(mark, size));
+    size_t name = mark + first.size() + 1;
+    if (first != "#-----------" || name >= size) continue;
+    std::string second = lineAt(data, size, name);
+    size_t last = name + second.size() + 1;
+    if (second.compare(0, 9, "snapshot=") != 0 || second.size() < 10 || !isdigit((unsigned char)second[9]) || last > size) continue;
+    if (lineAt(data, size, std::min(last, size)) == "#-----------") return mark;
+  }
+  return size;
+}
+
+// Split at the first snapshot start from cut: when the first range stops where a mark is
+// expected, parseFile keeps both ranges and they must stitch into the whole read
+static void checkSplit(const MappedFile &file, const ReadResult &whole, size_t cut) {
+  size_t start = SnapshotReader::findSnapshotStart(file, cut);
+  if (start != naiveSnapshotStart(file.data(), file.size(), cut)) fail("snapshot start missed", cut);
+  if (start == 0 || start >= file.size()) return;
+
+  ReadResult first = readRange(file, 0, start);
+  if (!first.resumable) return;
+  ReadResult second = readRange(file, start, file.size());
+  uint8_t titled = first.started == second.titleBase ? SNAPSHOT_TITLED : 0;
+  for (auto &snapshot : second.snapshots) {
+    snapshot.index += first.started;
+    snapshot.flags &= titled | SNAPSHOT_NEWLINE;
+  }
+  first.snapshots.insert(first.snapshots.end(), second.snapshots.begin(), second.snapshots.end());
+  first.headers.insert(first.headers.end(), second.headers.begin(), second.headers.end());
+
+  if (second.result != whole.result) fail("split read result differs", start);
+  if (first.headers != whole.headers) fail("split read headers differ", start);
+  if (first.snapshots.size() != whole.snapshots.size()) fail("split read snapshot count differs", start);
+  for (size_t i = 0; i < whole.snapshots.size(); i++) {
+    if (!sameSnapshot(first.snapshots[i], whole.snapshots[i])) fail("split read snapshot differs", whole.snapshots[i].offset);
+  }
+}
+
+// Scan from every line start with each scanner, they must stop at the same line
+static void checkScanners(const MappedFile &file) {
+  const char *data = file.data();
+  size_t size = file.size();
+  if (size > SCAN_BYTES) return;
+
+  std::vector<TreeScan> scans = {scanTreeScalar};
+#if defined(__x86_64__)
+  scans.push_back(scanTreeSse2);
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) scans.push_back(scanTreeAvx2);
+#endif
+  for (size_t offset = 0; offset < size;) {
+    uint64_t expectedLines = 0;
+    size_t expected = scanTreeScalar(data, offset, size, expectedLines);
+    for (size_t s = 1; s < scans.size(); s++) {
+      uint64_t lines = 0;
+      if (scans[s](data, offset, size, lines) != expected || lines != expectedLines) fail("tree scanners differ", offset);
+    }
+    const char *eol = static_cast<const char *>(memchr(data + offset, '\n', size - offset));
+    offset = eol == nullptr ? size : eol - data + 1;
+  }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *bytes, size_t size) {
+  // An anonymous copy, adopted like an io_uring read, so a compressed input is inflated
+  char *data = nullptr;
+  if (size > 0) {
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) return 0;
+    data = static_cast<char *>(addr);
+    memcpy(data, bytes, size);
+  }
+  MappedFile file;
+  if (file.adopt("fuzz input", data, size, size) != 0) return 0;
+
+  ReadResult whole = readRange(file, 0, file.size());
+  char title[64];
+  for (const auto &snapshot : whole.snapshots) {
+    if (snapshot.offset + snapshot.length > file.size()) fail("snapshot body past the end", snapshot.offset);
+    if (!(snapshot.flags & SNAPSHOT_NEWLINE) != (file.data()[snapshot.offset + snapshot.length - 1] != '\n')) {
+      fail("newline flag wrong", snapshot.offset);
+    }
+    int len = SnapshotReader::formatTitle(title, snapshot.index);
+    bool titled = snapshot.offset >= (size_t)len && memcmp(file.data() + snapshot.offset - len, title, len) == 0 &&
+                  (snapshot.offset == (size_t)len || file.data()[snapshot.offset - len - 1] == '\n');
+    if (titled != !!(snapshot.flags & SNAPSHOT_TITLED)) fail("title flag wrong", snapshot.offset);
+  }
+  for (size_t part = 1; part < 4; part++) {
+    checkSplit(file, whole, file.size() / 4 * part);
+  }
+  checkScanners(file);
+  return 0;
+}
+
+#ifndef MASSIF_LIBFUZZER
+// Run one corpus file through the target
+static int replayFile(const std::string &path) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) {
+    std::cerr << "Error reading " << path << std::endl;
+    return 1;
+  }
+  std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(content.data()), content.size());
+  return 0;
+}
+
+// Replay the files given and the files of the directories given, in name order
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0] << " <corpus-file-or-dir>..." << std::endl;
+    return -1;
+  }
+
+  size_t replayed = 0;
+  for (int a = 1; a < argc; a++) {
+    StringList paths;
+    DIR *dir = opendir(argv[a]);
+    if (dir == nullptr) {
+      paths.push_back(argv[a]);
+    } else {
+      while (struct dirent *entry = readdir(dir)) {
+        std::string path = std::string(argv[a]) + "/" + entry->d_name;
+        struct stat buf;
+        if (stat(path.c_str(), &buf) == 0 && S_ISREG(buf.st_mode)) paths.push_back(path);
+      }
+      closedir(dir);
+      std::sort(paths.begin(), paths.end());
+    }
+    for (auto &path : paths) {
+      if (replayFile(path) != 0) return 1;
+      replayed++;
+    }
+  }
+  std::cout << "Replayed " << replayed << " inputs" << std::endl;
+  return 0;
+}
+#endif
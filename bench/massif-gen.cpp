@@ -0,0 +1,204 @@
+// Generate synthetic massif files for benchmarking massif-combine
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+typedef struct {
+  std::string dir;
+  int files;
+  int snapshots;
+  double detailed;  // ratio of snapshots with a heap tree
+  int depth;
+  int fanout;
+  unsigned seed;
+  bool edge;        // write the edge case corpus instead
+} GenArgs;
+
+void usage(const char *app) {
+  std::cout << "Usage: " << app << " [-o dir] [-n files] [-s snapshots] [-r detailed] [-t depth] [-b fanout] [-S seed] [-e]" << std::endl;
+  std::cout << "\t\t-o dir: output directory, default bench/data" << std::endl;
+  std::cout << "\t\t-n files: number of massif.vgdb.* files, default 200" << std::endl;
+  std::cout << "\t\t-s snapshots: snapshots per file, default 40" << std::endl;
+  std::cout << "\t\t-r detailed: ratio of detailed snapshots, default 0.9" << std::endl;
+  std::cout << "\t\t-t depth: heap tree depth, default 5" << std::endl;
+  std::cout << "\t\t-b fanout: children per heap tree node, default 3" << std::endl;
+  std::cout << "\t\t-S seed: random seed, default 1" << std::endl;
+  std::cout << "\t\t-e: write the parser edge cases instead, one file each plus a file split in chunks" << std::endl;
+}
+
+// Write a heap tree node and its children, bytes are split between children
+void writeTree(std::ostream &out, std::mt19937_64 &rng, const GenArgs &args, int level, uint64_t bytes) {
+  int children = level < args.depth ? args.fanout : 0;
+  out << std::string(level, ' ') << 'n' << children << ": " << bytes << " 0x"
+      << std::hex << (rng() & 0xFFFFFFFF) << std::dec << ": func_" << level << '_' << bytes % 97
+      << " (src/file_" << level << ".cpp:" << bytes % 500 << ")\n";
+  for (int i = 0; i < children; i++) {
+    writeTree(out, rng, args, level + 1, bytes / (children + 1));
+  }
+}
+
+// Write one snapshot, a heap tree when tree is set
+void writeSnapshot(std::ostream &out, std::mt19937_64 &rng, const GenArgs &args, int index, uint64_t time,
+                   uint64_t heap, const char *tree) {
+  out << "#-----------\nsnapshot=" << index << "\n#-----------\n"
+      << "time=" << time << "\n"
+      << "mem_heap_B=" << heap << "\n"
+      << "mem_heap_extra_B=" << heap / 50 << "\n"
+      << "mem_stacks_B=0\n";
+  if (tree == nullptr) {
+    out << "heap_tree=empty\n";
+    return;
+  }
+  out << "heap_tree=" << tree << "\n";
+  writeTree(out, rng, args, 0, heap);
+}
+
+// Inputs the parser state machine has to get right whatever the scanner or the split
+int generateEdge(const GenArgs &args) {
+  static const char *HEADER = "desc: --time-unit=ms --detailed-freq=1\ncmd: ./app --serve\ntime_unit: ms\n";
+  std::mt19937_64 rng(args.seed);
+  std::vector<std::pair<std::string, std::string>> cases;
+  std::ostringstream out;
+
+  cases.push_back({"empty", ""});
+  cases.push_back({"header-only", HEADER});
+  cases.push_back({"header-no-newline", std::string(HEADER, strlen(HEADER) - 1)});
+
+  // Last snapshot ends with the file, in the middle of its heap tree
+  out.str("");
+  out << HEADER;
+  writeSnapshot(out, rng, args, 0, 10, 4096, "detailed");
+  writeSnapshot(out, rng, args, 1, 20, 8192, "peak");
+  std::string truncated = out.str();
+  cases.push_back({"eof-no-newline", truncated.substr(0, truncated.size() - 1)});
+  cases.push_back({"eof-in-tree", truncated.substr(0, truncated.size() - truncated.size() / 8)});
+
+  // Marks without a name, names without a mark and a snapshot without fields
+  out.str("");
+  out << HEADER << "#-----------\n#-----------\n";
+  writeSnapshot(out, rng, args, 0, 30, 100, nullptr);
+  out << "snapshot=1\n#-----------\n#-----------\nsnapshot=2\n#-----------\n";
+  writeSnapshot(out, rng, args, 3, 40, 200, "detailed");
+  out << "#-----------\n";
+  cases.push_back({"stray-marks", out.str()});
+
+  // A snapshot closed by the next mark before any field is dropped
+  out.str("");
+  out << HEADER << "#-----------\nsnapshot=0\n#-----------\n#-----------\nsnapshot=1\n#-----------\ntime=60\n";
+  cases.push_back({"no-fields", out.str()});
+
+  // Earlier than the files before it, and the same bodies again for --dedup
+  out.str("");
+  out << HEADER;
+  writeSnapshot(out, rng, args, 0, 5, 4096, "detailed");
+  writeSnapshot(out, rng, args, 1, 20, 8192, "peak");
+  cases.push_back({"out-of-order", out.str()});
+  cases.push_back({"duplicate", out.str()});
+
+  // Lines longer than any scanner block and a tree deeper than any file above
+  GenArgs deep = args;
+  deep.depth = 200;
+  deep.fanout = 1;
+  out.str("");
+  out << HEADER;
+  writeSnapshot(out, rng, deep, 0, 70, 1 << 30, "peak");
+  out << "#-----------\nsnapshot=1\n#-----------\ntime=80\nmem_heap_B=1\nmem_heap_extra_B=0\nmem_stacks_B=0\n"
+      << "heap_tree=detailed\nn0: 1 0x1: " << std::string(4096, 'f') << " (src/long.cpp:1)\n";
+  out << "trailing line after the last snapshot\n";
+  cases.push_back({"long-lines", out.str()});
+
+  mkdir(args.dir.c_str(), 0777);
+  for (size_t c = 0; c < cases.size(); c++) {
+    char name[64];
+    snprintf(name, sizeof(name), "/massif.vgdb.%02zu-%s", c, cases[c].first.c_str());
+    std::ofstream file(args.dir + name, std::ios::binary);
+    file << cases[c].second;
+    file.close();
+    if (!file) {
+      std::cerr << "Error creating " << args.dir << name << std::endl;
+      return 1;
+    }
+  }
+
+  // Large enough to be parsed in chunks, with a stray mark where a split could land
+  char name[64];
+  snprintf(name, sizeof(name), "/massif.vgdb.%02zu-chunked", cases.size());
+  std::ofstream file(args.dir + name);
+  file << HEADER;
+  uint64_t time = 100;
+  for (int s = 0; s < 2400; s++) {
+    time += 1 + rng() % 1000;
+    if (s == 1200) file << "#-----------\n";
+    writeSnapshot(file, rng, args, s, time, 1000 + rng() % 1000000000, s % 10 == 0 ? nullptr : "detailed");
+  }
+  file.close();
+  return file ? 0 : 1;
+}
+
+int generate(const GenArgs &args) {
+  std::mt19937_64 rng(args.seed);
+  std::uniform_real_distribution<double> ratio(0.0, 1.0);
+  uint64_t time = 0;
+
+  mkdir(args.dir.c_str(), 0777);
+  for (int f = 0; f < args.files; f++) {
+    char name[32];
+    snprintf(name, sizeof(name), "/massif.vgdb.%06d", f);
+    std::ofstream out(args.dir + name);
+    if (!out) {
+      std::cerr << "Error creating " << args.dir << name << std::endl;
+      return 1;
+    }
+
+    // Every file gets its own time range, like snapshots taken one after another
+    out << "desc: --time-unit=ms --detailed-freq=1\ncmd: ./app --serve\ntime_unit: ms\n";
+    std::vector<uint64_t> heaps(args.snapshots);
+    std::vector<bool> detailed(args.snapshots);
+    int peak = -1;
+    for (int s = 0; s < args.snapshots; s++) {
+      heaps[s] = 1000 + rng() % 1000000000;
+      detailed[s] = ratio(rng) < args.detailed;
+      if (detailed[s] && (peak < 0 || heaps[s] > heaps[peak])) peak = s;
+    }
+
+    for (int s = 0; s < args.snapshots; s++) {
+      time += 1 + rng() % 1000;
+      writeSnapshot(out, rng, args, s, time, heaps[s], !detailed[s] ? nullptr : s == peak ? "peak" : "detailed");
+    }
+
+    out.close();
+    if (!out) return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char * const* argv) {
+  GenArgs args = { "bench/data", 200, 40, 0.9, 5, 3, 1, false };
+  int opt;
+  while ((opt = getopt(argc, argv, "ho:n:s:r:t:b:S:e")) != -1) {
+    switch (opt) {
+    case 'o': args.dir = optarg; break;
+    case 'n': args.files = atoi(optarg); break;
+    case 's': args.snapshots = atoi(optarg); break;
+    case 'r': args.detailed = atof(optarg); break;
+    case 't': args.depth = atoi(optarg); break;
+    case 'b': args.fanout = atoi(optarg); break;
+    case 'S': args.seed = atoi(optarg); break;
+    case 'e': args.edge = true; break;
+    default:
+      usage(argv[0]);
+      return -1;
+    }
+  }
+
+  return args.edge ? generateEdge(args) : generate(args);
+}
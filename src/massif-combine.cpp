@@ -1,271 +1,73 @@
+// Command line tool of libmassif-combine, its Clock and helpers come from massif-internal.h
+#include "massif-internal.h"
+
 #include <iostream>
-#include <fstream>
-#include <vector>
-#include <initializer_list>
-#include <memory>
-#include <string>
-#include <regex>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <thread>
+#include <chrono>
 
 #include <unistd.h>
 #include <limits.h>
 #include <sys/stat.h>
-
-typedef std::vector<std::string> StringList;
-
-typedef struct {
-  int time;
-  StringList contents;
-} Snapshot;
-
-class MassifFile {
-public:
-  StringList headers;
-  std::vector<std::shared_ptr<Snapshot>> snapshots;
-
-public:
-  MassifFile() {
-  }
-
-  MassifFile(std::initializer_list<std::string> paths) {
-    add(paths);
-  }
-
-  /**
-   * @brief Add a massif files to this class
-   * 
-   * @param paths path to massif files
-   * @return int 0 if success, or fails
-   */
-  int add(std::initializer_list<std::string> &paths) {
-    return add(paths.begin(), paths.end());
-  }
-
-  /**
-   * @brief Add a massif files to this class
-   * 
-   * @param paths path to massif files
-   * @return int 0 if success, or fails
-   */
-  int add(std::vector<std::string> &paths) {
-    return add(paths.begin(), paths.end());
-  }
-
-  template <class It>
-  int add(It first, It last) {
-    int ret = 0, r;
-    for (auto it = first; it != last; ++it) {
-      if ((r = add(*it)) != 0) {
-        ret = r;
-      };
-    }
-
-    return ret;
-  }
-
-  /**
-   * @brief Add a massif file to this class
-   * 
-   * @param path path to massif file
-   * @return int 0 if success, or fails
-   */
-  int add(const std::string path) {
-    return appendFile(path, headers.size() > 0);
-  }
-
-  /**
-   * @brief Write whole content to a new massif file
-   * 
-   * @param path new massif file path
-   * @return int 0 if success, or fails
-   */
-  int write(const std::string path) {
-    if (headers.size() <= 0 && snapshots.size() <=0) {
-      std::cerr << "WARN: No content, exit" << std::endl;
-      return -1;
-    }
-
-    // Sort snapshots
-    std::sort(snapshots.begin(), snapshots.end(), 
-          [](auto &a, auto &b) -> bool {
-            return a->time < b->time; 
-    });
-
-    std::ofstream file(path);
-    if (!file) return 1; // Error open file
-
-    // Write header
-    writeList(file, headers);
-    if (!file) return 2; // Error write file
-
-    // Write snapshot
-    for (int i = 0; i < snapshots.size(); i++) {
-      writeSnapshot(file, i, snapshots[i]);
-      if (!file) return 2; // Error write file
-    }
-    file.close();
-    if (!file) return 3; // Error close file
-    return 0;
-  }
-
-private:
-  // Write a string list to stream
-  void writeList(std::ofstream &stream, StringList &list) {
-    std::ostream_iterator<std::string> output_iterator(stream, "\n");
-    std::copy(std::begin(list), std::end(list), output_iterator);
-  }
-
-  // Write snapshot header and content
-  void writeSnapshot(std::ofstream &stream, int index, std::shared_ptr<Snapshot> &snapshot) {
-    std::vector<std::string> titles = {"#-----------",
-                                       "snapshot=" + std::to_string(index),
-                                       "#-----------"};
-    writeList(stream, titles);
-    writeList(stream, snapshot->contents);
-  }
-
-  // Read massif output file and append snapshot
-  int appendFile(std::string path, bool ignore_header = true) {
-    typedef enum {
-      HEADER,
-      SNAPSHOT_MARK,
-      SNAPSHOT_NAME,
-      SNAPSHOT_CONTENT,
-      NONE,
-    } LastLine;
-
-    // const variable
-    std::regex const keyword_regex = std::regex("^(desc|cmd|time_unit):");
-    std::string const snapshot_mark = "#-----------";
-    std::regex const snapshot_regex = std::regex("snapshot=\\d+");
-    std::regex const snapshot_time_regex = std::regex("time=(\\d+)");
-
-    std::ifstream file(path);
-    std::string str;
-    LastLine status = LastLine::NONE;
-
-    if (!file) return 1; // error open file
-
-    std::smatch match;
-    std::shared_ptr<Snapshot> snapshot = nullptr;
-    while (std::getline(file, str)) {
-      if (std::regex_search(str, keyword_regex)) {
-        status = LastLine::HEADER;
-        if (!ignore_header) {
-          this->headers.push_back(str);
-        }
-
-        continue;
-      }
-
-      if ((status == LastLine::HEADER || status == LastLine::SNAPSHOT_CONTENT) && str == snapshot_mark) {
-        status = LastLine::SNAPSHOT_MARK;
-        if (snapshot != nullptr && snapshot->contents.size() > 0) {
-          this->snapshots.push_back(snapshot);
-        }
-        snapshot = nullptr;
-        continue;
-      }
-
-      if (status == LastLine::SNAPSHOT_MARK && std::regex_search(str, snapshot_regex)) {
-        status = LastLine::SNAPSHOT_NAME;
-        continue;
-      }
-
-      if (status == LastLine::SNAPSHOT_NAME && str == snapshot_mark) {
-        status = LastLine::SNAPSHOT_CONTENT;
-        if (snapshot == nullptr) {
-          snapshot = std::make_shared<Snapshot>();
-        } else {
-          std::cerr << "WARN: found new snapshot but existing another snapshot" << std::endl;
-          return 2; // error when handling file
-        }
-        continue;
-      }
-
-      if (status == LastLine::SNAPSHOT_CONTENT) {
-        if (snapshot == nullptr) {
-          std::cerr << "WARN: snapshot should not empty now" << std::endl;
-          return 2; // error when handling file
-        } else {
-          snapshot->contents.push_back(str);
-          if (std::regex_search(str, match, snapshot_time_regex)) {
-            snapshot->time = std::stoi(match[1]);
-          }
-        }
-      }
-    }
-
-    if (snapshot != nullptr && snapshot->contents.size() > 0) {
-      this->snapshots.push_back(snapshot);
-    }
-
-    return 0;
-  }
-};
+#include <fnmatch.h>
+#include <getopt.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
 
 void usage(const char *app) {
-  std::cout << "Usage: %s [-o output] [-d] [-v] <file-pattern>..." << std::endl;
-  std::cout << "\t\t-o output: specify output file path" << std::endl;
-  std::cout << "\t\t-d: after combining, delete input files" << std::endl;
+  std::cout << "Usage: " << app << " [-o output] [-d] [-v] [-j jobs] [-s] [--append] [--max-snapshots=N] [--bucket=T] [--tree=MODE] [--watch=DIR] [--dedup] [--cache=FILE] [--from=T] [--to=T] [--min-heap=B] [--passthrough] [--io-uring] [--group] [--index] [--summary[=json]] [--stats[=json]] <file-pattern>..." << std::endl;
+  std::cout << "\t\t-o output: specify output file path, compressed when ending in .gz or .zst" << std::endl;
+  std::cout << "\t\t-d: after combining, delete input files once the output is synced to disk" << std::endl;
   std::cout << "\t\t-v: verbose processing" << std::endl;
-  std::cout << "\t\tfile-pattern: input file list, can include * character" << std::endl;
+  std::cout << "\t\t-j jobs: number of threads parsing input files, a large file is split between idle ones, default 1" << std::endl;
+  std::cout << "\t\t-s: stream, merge inputs already ordered by time without loading them all, -j parses ahead" << std::endl;
+  std::cout << "\t\t--append: add inputs to an existing output file, only new inputs are parsed" << std::endl;
+  std::cout << "\t\t--max-snapshots=N: keep at most N snapshots besides detailed and peak ones" << std::endl;
+  std::cout << "\t\t--bucket=T: keep the largest mem_heap_B per T time units besides detailed and peak ones" << std::endl;
+  std::cout << "\t\t--tree=aggregate|delta:A:B: write one merged heap tree instead, summed over detailed snapshots or B minus A, a node at least its children, shrunk as 0 B [delta -N B]" << std::endl;
+  std::cout << "\t\t--watch=DIR: keep appending the files matching file-pattern names as they appear in DIR, other than the output, until SIGINT/SIGTERM" << std::endl;
+  std::cout << "\t\t--dedup: drop snapshots repeating an earlier one, and inputs that are the same file" << std::endl;
+  std::cout << "\t\t--cache=FILE: save the parsed inputs to a binary cache, or combine from it when no input is given" << std::endl;
+  std::cout << "\t\t--from=T, --to=T: keep only the snapshots with T <= time, time <= T, inputs outside of the window are not read" << std::endl;
+  std::cout << "\t\t--min-heap=B: keep only the snapshots with mem_heap_B >= B" << std::endl;
+  std::cout << "\t\t--passthrough: copy snapshot bodies from file to file in the kernel, the inputs are not kept in memory (-s already streams)" << std::endl;
+  std::cout << "\t\t--io-uring: open and read many small input files at once, for network file systems" << std::endl;
+  std::cout << "\t\t--group: one output per process, inputs with the same desc, cmd and time_unit lines go to output.N" << std::endl;
+  std::cout << "\t\t--index: also write a binary snapshot index to output.idx" << std::endl;
+  std::cout << "\t\t--query=peak|FROM:TO: print snapshots of output picked through its index" << std::endl;
+  std::cout << "\t\t--summary[=text|json]: print the peak, top allocation sites and heap growth instead of writing output" << std::endl;
+  std::cout << "\t\t--stats[=text|json]: print counters and phase timings, -v prints them as text" << std::endl;
+  std::cout << "\t\tfile-pattern: input file list, can include * character, gzip/zstd files are decompressed in memory, a block at a time with -s and --summary" << std::endl;
 }
 
-bool fileExists(const std::string file) {
-  struct stat buf;
-  return (stat(file.c_str(), &buf) == 0);
-}
-
-bool deleteFiles(std::vector<std::string>& files, bool verbose = false) {
-  bool ret = true;
-  for (auto& file : files) {
-    if (verbose) {
-      std::cout << "Deleting file " << file << std::endl;
-    }
-    // Delete file
-    if (remove(file.c_str()) < 0) {
-      std::cerr << "[" << errno << "]" << "Error removing file " << file << std::endl;
-      ret = false;
-    }
-  }
-
-  return ret;
-}
-
-int listFile(std::vector<std::string>& files, std::string pattern) {
-  char buffer[PATH_MAX];
-  snprintf(buffer, PATH_MAX, "ls -1 %s", pattern.c_str());
-
-  int len;
-  FILE* pipe = popen(buffer, "r");
-  if (!pipe) return 1; // exec fail
-  try {
-    while (fgets(buffer, sizeof(buffer), pipe) != NULL) {
-      len = strlen(buffer);
-      if (len >= 1 && buffer[len-1] == '\n') {
-        if (len >= 2 && buffer[len-2] == '\r') {
-          buffer[len-2] = '\0';
-        } else {
-          buffer[len-1] = '\0';
-        }
-      }
-      if (fileExists(buffer)) {
-        files.push_back(buffer);
-      }
-    }
-  } catch (...) {
-    pclose(pipe);
-    throw;
-  }
-  pclose(pipe);
-  return 0;
-}
 
 #define DEFAULT_OUTPUTNAME  "massif.out.combine"
 class InputArgs {
 public:
   bool deleteSuccess;
   bool verbose;
+  bool streaming;
+  bool append;
+  bool index;
+  bool dedup;
+  bool passthrough;
+  bool ioUring;
+  bool group;
+  std::string tree;        // heap tree output mode, empty to combine snapshots
+  Retention retention;
+  SnapshotFilter filter;
+  unsigned jobs;
+  std::string query;       // index query, empty when combining
+  std::string stats;       // stats report format, empty for none
+  std::string summary;     // summary report format, empty to combine
+  std::string cache;       // parsed state cache, loaded when there is no input
+  std::string watch;       // directory watched for new inputs, empty to combine once
+  std::vector<std::string> patterns;     // file name patterns of watched inputs
+  double listTime;         // seconds spent expanding file patterns
   std::string outputFile;
   std::vector<std::string> inputFiles;
 
@@ -273,6 +75,15 @@ public:
   InputArgs() : 
     deleteSuccess(false),
     verbose(false),
+    streaming(false),
+    append(false),
+    index(false),
+    dedup(false),
+    passthrough(false),
+    ioUring(false),
+    group(false),
+    jobs(1),
+    listTime(0),
     outputFile(DEFAULT_OUTPUTNAME) {
   }
 
@@ -283,9 +94,31 @@ public:
   ~InputArgs() {}
 
   void parse(int argc, char * const* argv) {
+    enum { OPT_STATS = 256, OPT_APPEND, OPT_INDEX, OPT_QUERY, OPT_MAX_SNAPSHOTS, OPT_BUCKET, OPT_TREE, OPT_WATCH, OPT_DEDUP, OPT_CACHE, OPT_FROM, OPT_TO, OPT_MIN_HEAP, OPT_SUMMARY, OPT_PASSTHROUGH, OPT_IO_URING, OPT_GROUP };
+    static const struct option longOptions[] = {
+      {"stats", optional_argument, NULL, OPT_STATS},
+      {"append", no_argument, NULL, OPT_APPEND},
+      {"index", no_argument, NULL, OPT_INDEX},
+      {"query", required_argument, NULL, OPT_QUERY},
+      {"max-snapshots", required_argument, NULL, OPT_MAX_SNAPSHOTS},
+      {"bucket", required_argument, NULL, OPT_BUCKET},
+      {"tree", required_argument, NULL, OPT_TREE},
+      {"watch", required_argument, NULL, OPT_WATCH},
+      {"dedup", no_argument, NULL, OPT_DEDUP},
+      {"cache", required_argument, NULL, OPT_CACHE},
+      {"from", required_argument, NULL, OPT_FROM},
+      {"to", required_argument, NULL, OPT_TO},
+      {"min-heap", required_argument, NULL, OPT_MIN_HEAP},
+      {"summary", optional_argument, NULL, OPT_SUMMARY},
+      {"passthrough", no_argument, NULL, OPT_PASSTHROUGH},
+      {"io-uring", no_argument, NULL, OPT_IO_URING},
+      {"group", no_argument, NULL, OPT_GROUP},
+      {NULL, 0, NULL, 0},
+    };
+
     // Retrieve the options:
     int opt;
-    while ((opt = getopt(argc, argv, "vdo:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "vdso:j:", longOptions, NULL)) != -1) {
       // for each option...
       switch (opt) {
       case 'v':
@@ -297,11 +130,78 @@ public:
       case 'd':
         deleteSuccess = true;
         break;
+      case 's':
+        streaming = true;
+        break;
+      case 'j':
+        jobs = std::max(1, atoi(optarg));
+        break;
+      case OPT_STATS:
+        stats = optarg ? optarg : "text";
+        break;
+      case OPT_APPEND:
+        append = true;
+        break;
+      case OPT_INDEX:
+        index = true;
+        break;
+      case OPT_QUERY:
+        query = optarg;
+        break;
+      case OPT_MAX_SNAPSHOTS:
+        retention.maxSnapshots = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_BUCKET:
+        retention.bucket = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_TREE:
+        tree = optarg;
+        break;
+      case OPT_WATCH:
+        watch = optarg;
+        break;
+      case OPT_DEDUP:
+        dedup = true;
+        break;
+      case OPT_CACHE:
+        cache = optarg;
+        break;
+      case OPT_FROM:
+        filter.from = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_TO:
+        filter.to = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_MIN_HEAP:
+        filter.minHeap = strtoull(optarg, NULL, 10);
+        break;
+      case OPT_SUMMARY:
+        summary = optarg ? optarg : "text";
+        break;
+      case OPT_PASSTHROUGH:
+        passthrough = true;
+        break;
+      case OPT_IO_URING:
+        ioUring = true;
+        break;
+      case OPT_GROUP:
+        group = true;
+        break;
       default: // unknown option...
         break;
       }
     }
 
+    if (!watch.empty()) {
+      // Name patterns of files to come, matched when they appear
+      patterns.assign(argv + optind, argv + argc);
+      if (patterns.empty()) {
+        patterns.push_back("massif.vgdb.*");
+      }
+      return;
+    }
+
+    Clock::time_point start = Clock::now();
     for (int i = optind; i < argc; i++) {
       if (fileExists(argv[i])) {
         inputFiles.push_back(argv[i]);
@@ -312,9 +212,149 @@ public:
         }
       }
     }
+    listTime = secondsSince(start);
   }
 };
 
+static volatile sig_atomic_t stopWatching = 0;
+
+static void onStopSignal(int) {
+  stopWatching = 1;
+}
+
+// Append a batch of new inputs to the output, then delete them with -d
+static int combineBatch(const InputArgs &args, std::vector<std::string> &files) {
+  // A file rewritten within a batch shows up more than once
+  std::sort(files.begin(), files.end());
+  files.erase(std::unique(files.begin(), files.end()), files.end());
+
+  MassifFile massifFile;
+  massifFile.setIndexOutput(args.index);
+  massifFile.setRetention(args.retention);
+  massifFile.setDedup(args.dedup);
+  massifFile.setFilter(args.filter);
+  massifFile.setPassthrough(args.passthrough);
+  massifFile.setIoUring(args.ioUring);
+  std::vector<std::string> inputs = files;
+  massifFile.skipSameFiles(inputs);
+  massifFile.add(inputs, args.jobs);
+  int ret = massifFile.append(args.outputFile);
+  if (args.verbose) {
+    std::cout << "Combined: " << files.size() << " files  Size: " << massifFile.snapshots().size() << std::endl;
+  }
+  if (ret != 0) {
+    std::cerr << "WARN: cannot update " << args.outputFile << ", error " << ret << std::endl;
+  } else if (args.deleteSuccess) {
+    deleteFiles(files, args.verbose);
+  }
+  files.clear();
+  return ret;
+}
+
+// Path with its directory resolved, the same for two names of one file, which may not exist yet
+static std::string resolvedPath(const std::string &path) {
+  size_t slash = path.rfind('/');
+  std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+  char resolved[PATH_MAX];
+  if (realpath(dir.c_str(), resolved) == NULL) return path;
+  std::string result = resolved;
+  if (result.back() != '/') result += '/';
+  return result + (slash == std::string::npos ? path : path.substr(slash + 1));
+}
+
+/**
+ * @brief Keep the output updated with files appearing in the watched directory, until
+ * SIGINT or SIGTERM. Files are picked up once closed after writing, or moved in, and
+ * a burst of them is appended at once when the directory is quiet for WATCH_QUIET_MS,
+ * or after WATCH_DELAY_MS at most. Files matching already are combined first. The output,
+ * the file it is written aside to and their indexes are never inputs, even when they match
+ * 
+ * @param args parsed arguments, patterns are matched against file names
+ * @return int 0 if success, or fails
+ */
+static int watchFiles(const InputArgs &args) {
+  const int WATCH_QUIET_MS = 200;
+  const int WATCH_DELAY_MS = 2000;
+
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0) return 1; // Error watch directory
+  if (inotify_add_watch(fd, args.watch.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    std::cerr << "WARN: cannot watch " << args.watch << std::endl;
+    close(fd);
+    return 1;
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = onStopSignal; // no SA_RESTART, poll returns on signal
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  std::vector<std::string> own;
+  for (const std::string &path : {args.outputFile, tempPathOf(args.outputFile)}) {
+    own.push_back(resolvedPath(path));
+    own.push_back(resolvedPath(SnapshotIndex::pathOf(path)));
+  }
+  auto isOwn = [&](const std::string &path) {
+    return std::find(own.begin(), own.end(), resolvedPath(path)) != own.end();
+  };
+
+  // Files written before the watch started
+  std::string prefix = args.watch.back() == '/' ? args.watch : args.watch + "/";
+  std::vector<std::string> batch;
+  for (auto &pattern : args.patterns) {
+    listFile(batch, prefix + pattern);
+  }
+  batch.erase(std::remove_if(batch.begin(), batch.end(), isOwn), batch.end());
+  if (!batch.empty()) {
+    combineBatch(args, batch);
+  }
+
+  alignas(struct inotify_event) char events[64 * (sizeof(struct inotify_event) + NAME_MAX + 1)];
+  Clock::time_point first;
+  while (!stopWatching) {
+    int timeout = -1;
+    if (!batch.empty()) {
+      int waited = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - first).count();
+      timeout = std::max(0, std::min(WATCH_QUIET_MS, WATCH_DELAY_MS - waited));
+    }
+
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int ready = poll(&pfd, 1, timeout);
+    if (ready < 0 && errno != EINTR) break;
+    if (ready <= 0) {
+      if (!batch.empty()) {
+        combineBatch(args, batch);
+      }
+      continue;
+    }
+
+    ssize_t length = read(fd, events, sizeof(events));
+    for (char *ptr = events; length > 0 && ptr < events + length; ) {
+      struct inotify_event *event = reinterpret_cast<struct inotify_event *>(ptr);
+      ptr += sizeof(struct inotify_event) + event->len;
+      if (event->len == 0 || (event->mask & IN_ISDIR)) continue;
+
+      for (auto &pattern : args.patterns) {
+        if (fnmatch(pattern.c_str(), event->name, FNM_PERIOD) == 0) {
+          std::string path = prefix + event->name;
+          if (isOwn(path)) break; // written by the last batch
+          if (batch.empty()) first = Clock::now();
+          batch.push_back(path);
+          break;
+        }
+      }
+    }
+  }
+
+  // Flush what arrived before the stop
+  if (!batch.empty()) {
+    combineBatch(args, batch);
+  }
+  close(fd);
+  return 0;
+}
+
 int main(int argc, char * const* argv) {
   if (argc <= 1) {
     usage(argv[0]);
@@ -322,19 +362,101 @@ int main(int argc, char * const* argv) {
   }
 
   InputArgs args(argc, argv);
+  if (!args.query.empty()) {
+    return queryIndex(args.outputFile, args.query);
+  }
+  if (!args.watch.empty()) {
+    return watchFiles(args);
+  }
+
   MassifFile massifFile;
-  for (auto& file : args.inputFiles) {
-    massifFile.add(file);
+  massifFile.setIndexOutput(args.index);
+  massifFile.setRetention(args.retention);
+  massifFile.setDedup(args.dedup);
+  massifFile.setFilter(args.filter);
+  massifFile.setPassthrough(args.passthrough);
+  massifFile.setIoUring(args.ioUring);
+  std::vector<std::string> inputs = args.inputFiles;
+  massifFile.skipSameFiles(inputs);
+  int ret;
+  if (!args.summary.empty()) {
+    // One pass over the inputs, nothing is written but the summary
+    Summary summary;
+    ret = massifFile.visit(inputs, summary);
+    if (summary.count == 0) {
+      std::cerr << "WARN: No content, exit" << std::endl;
+      ret = -1;
+    } else if (args.summary == "json") {
+      summary.printJson(std::cout);
+    } else {
+      summary.print(std::cout);
+    }
+  } else if (args.group) {
+    // One parse pass, one output per process
+    if (args.append || !args.tree.empty() || !args.cache.empty()) {
+      std::cerr << "WARN: --group writes new outputs, --append, --tree and --cache are ignored" << std::endl;
+    }
+    std::vector<std::string> outputs;
+    ret = massifFile.writeGroups(inputs, args.outputFile, args.jobs, &outputs);
     if (args.verbose) {
-      std::cout << "Input: " << file;
-      std::cout << "  Size: " << massifFile.snapshots.size() << std::endl;
+      for (auto &output : outputs) {
+        std::cout << "Output: " << output << std::endl;
+      }
+    }
+  } else if (args.streaming && !args.append && !args.retention.enabled() && args.tree.empty() && !args.dedup && args.cache.empty()) {
+    if (args.verbose) {
+      for (auto& file : inputs) {
+        std::cout << "Input: " << file << std::endl;
+      }
+    }
+    ret = massifFile.stream(inputs, args.outputFile, args.jobs);
+  } else {
+    if (args.jobs > 1 || args.ioUring) {
+      massifFile.add(inputs, args.jobs); // one ring reads ahead for every input
+      if (args.verbose) {
+        std::cout << "Input: " << inputs.size() << " files";
+        std::cout << "  Size: " << massifFile.snapshots().size() << std::endl;
+      }
+    } else {
+      for (auto& file : inputs) {
+        massifFile.add(file);
+        if (args.verbose) {
+          std::cout << "Input: " << file;
+          std::cout << "  Size: " << massifFile.snapshots().size() << std::endl;
+        }
+      }
+    }
+    if (!args.cache.empty() && inputs.empty()) {
+      // Nothing to parse, combine again from the parsed state of an earlier run
+      if (massifFile.loadCache(args.cache) != 0) {
+        std::cerr << "WARN: cannot load cache " << args.cache << std::endl;
+      }
+    } else if (!args.cache.empty() && massifFile.saveCache(args.cache) != 0) {
+      std::cerr << "WARN: cannot save cache " << args.cache << std::endl;
+    }
+    if (!args.tree.empty()) {
+      ret = massifFile.writeTree(args.outputFile, args.tree);
+    } else {
+      ret = args.append ? massifFile.append(args.outputFile) : massifFile.write(args.outputFile);
     }
   }
 
-  if (massifFile.write(args.outputFile) == 0 && args.deleteSuccess) {
-    // Delete input file
-    deleteFiles(args.inputFiles, args.verbose);
+  if (ret == 0 && args.deleteSuccess && args.summary.empty()) {
+    // Delete input file, skipped copies too, each path once
+    std::vector<std::string> files = args.inputFiles;
+    if (args.dedup) {
+      std::sort(files.begin(), files.end());
+      files.erase(std::unique(files.begin(), files.end()), files.end());
+    }
+    deleteFiles(files, args.verbose);
+  }
+
+  massifFile.stats().listTime = args.listTime;
+  if (args.stats == "json") {
+    massifFile.stats().printJson(std::cout);
+  } else if (args.verbose || !args.stats.empty()) {
+    massifFile.stats().print(std::cout);
   }
 
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,354 @@
+// Combine massif output files: the library API used by massif-combine and
+// bench/massif-bench, link with libmassif-combine.a
+#ifndef MASSIF_COMBINE_H
+#define MASSIF_COMBINE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Kind of heap tree of a snapshot, from its heap_tree= line
+typedef enum : uint8_t {
+  HEAP_TREE_NONE,
+  HEAP_TREE_EMPTY,
+  HEAP_TREE_DETAILED,
+  HEAP_TREE_PEAK,
+} HeapTree;
+
+// What the parser saw around a body, so that writers need not read it again
+typedef enum : uint8_t {
+  SNAPSHOT_NEWLINE = 1,   // the body ends with a newline, the last one of a file may not
+  SNAPSHOT_TITLED = 2,    // right after the lines "#-----------", "snapshot=<index>", "#-----------"
+} SnapshotFlags;
+
+// Snapshot record, the body lines are one contiguous range of its mapped input file
+typedef struct {
+  uint64_t time;
+  uint64_t memHeap;       // mem_heap_B
+  uint64_t memHeapExtra;  // mem_heap_extra_B
+  uint64_t memStacks;     // mem_stacks_B
+  size_t offset;          // start of the body lines in the input file
+  size_t length;          // size of the body lines, including their newlines
+  uint32_t source;        // index of the mapped input file holding the lines
+  uint32_t index;         // position of the snapshot in its input file
+  uint32_t hash;          // hash of the body for --dedup, 0 when not hashed
+  uint8_t heapTree;       // HeapTree
+  uint8_t flags;          // SnapshotFlags
+} Snapshot;
+
+// Counters and phase timings, reported by -v and --stats
+typedef struct Stats {
+  uint64_t files = 0;
+  uint64_t bytes = 0;          // input bytes read
+  uint64_t chunks = 0;         // ranges parsed by one reader each, more than files when large ones are split
+  uint64_t headerLines = 0;    // lines per parser state
+  uint64_t markLines = 0;
+  uint64_t nameLines = 0;
+  uint64_t contentLines = 0;
+  uint64_t otherLines = 0;     // lines outside of any section, ignored
+  uint64_t kept = 0;           // snapshots added
+  uint64_t dropped = 0;        // snapshots without content or cut by an error
+  uint64_t filtered = 0;       // snapshots removed by retention policies or filters
+  uint64_t duplicates = 0;     // snapshots removed by --dedup
+  uint64_t skipped = 0;        // inputs not read: same file as an earlier one, or outside the filter window
+  double listTime = 0;         // phase timings in seconds
+  double parseTime = 0;
+  double sortTime = 0;
+  double writeTime = 0;
+
+  // Add the counters of other, timings are measured by the owner
+  void merge(const Stats &other) {
+    files += other.files;
+    bytes += other.bytes;
+    chunks += other.chunks;
+    headerLines += other.headerLines;
+    markLines += other.markLines;
+    nameLines += other.nameLines;
+    contentLines += other.contentLines;
+    otherLines += other.otherLines;
+    kept += other.kept;
+    dropped += other.dropped;
+    filtered += other.filtered;
+    duplicates += other.duplicates;
+    skipped += other.skipped;
+  }
+
+  // Peak resident memory of the process in kB
+  static long peakMemory();
+
+  void print(std::ostream &out) const;
+  void printJson(std::ostream &out) const;
+} Stats;
+
+// Snapshot retention policies applied between parsing and writing,
+// detailed and peak snapshots are always kept
+typedef struct {
+  size_t maxSnapshots = 0;  // keep at most this many, spread over time, 0 for no limit
+  uint64_t bucket = 0;      // keep the largest mem_heap_B per time bucket, 0 for no bucketing
+
+  bool enabled() const { return maxSnapshots > 0 || bucket > 0; }
+} Retention;
+
+// Snapshot filters evaluated by the parser on the fields at the top of each body,
+// rejected snapshots are never stored. Unlike retention, detailed and peak snapshots
+// are filtered too
+typedef struct {
+  uint64_t from = 0;            // keep from <= time <= to
+  uint64_t to = UINT64_MAX;
+  uint64_t minHeap = 0;         // keep mem_heap_B >= minHeap
+
+  bool enabled() const { return hasWindow() || minHeap > 0; }
+  bool hasWindow() const { return from > 0 || to < UINT64_MAX; }
+  bool accepts(const Snapshot &snapshot) const {
+    return snapshot.time >= from && snapshot.time <= to && snapshot.memHeap >= minHeap;
+  }
+} SnapshotFilter;
+
+// Receives the snapshots of MassifFile::visit as they are parsed, the views
+// are valid until the call returns
+class SnapshotVisitor {
+public:
+  virtual ~SnapshotVisitor() {}
+
+  /**
+   * @brief Called for each header line (desc:, cmd:, time_unit:) of an input
+   * 
+   * @param input position of the input in the visited paths
+   * @param line header line without its newline
+   */
+  virtual void header(size_t, std::string_view) {}
+
+  /**
+   * @brief Called for each snapshot of an input, in file order
+   * 
+   * @param input position of the input in the visited paths
+   * @param snapshot parsed fields of the snapshot
+   * @param body snapshot lines after its "snapshot=N" marks, valid during the call only
+   * @return bool true to go on, false to stop the visit
+   */
+  virtual bool snapshot(size_t input, const Snapshot &snapshot, std::string_view body) = 0;
+};
+
+// Aggregates of a run computed in one pass over its snapshots, fed by MassifFile::visit
+// in bounded memory: running peak and growth, and the largest allocation sites of the
+// biggest detailed snapshot
+class Summary : public SnapshotVisitor {
+public:
+  // Allocation site of a heap tree, a top level node
+  typedef struct {
+    uint64_t bytes;
+    std::string label;    // "0x...: func (file:line)" or "in N places, ..."
+  } Site;
+
+  size_t count = 0;           // snapshots seen
+  uint64_t firstTime = 0;
+  uint64_t lastTime = 0;
+  Snapshot peak;              // most memory, heap, heap extra and stacks together
+  Snapshot detailed;          // same among detailed and peak snapshots, its sites below
+  bool hasDetailed = false;
+  std::vector<Site> sites;    // largest first
+  std::string timeUnit;       // from the time_unit: header line
+
+  /**
+   * @param topSites number of allocation sites to keep
+   */
+  explicit Summary(size_t topSites = 10);
+
+  void header(size_t, std::string_view line) override;
+  bool snapshot(size_t, const Snapshot &snapshot, std::string_view body) override;
+
+  // Least squares slope of mem_heap_B over time, bytes per time unit
+  double growth() const;
+
+  void print(std::ostream &out) const;
+  void printJson(std::ostream &out) const;
+
+private:
+  size_t topSites;
+  double meanTime = 0;        // running means and co-moments of the growth fit
+  double meanHeap = 0;
+  double timeHeap = 0;
+  double timeTime = 0;
+};
+
+// Combined snapshots of massif files, loaded fully in memory. Move-only, it owns
+// the mappings of its inputs; a moved-from MassifFile can only be assigned or destroyed
+class MassifFile {
+public:
+  MassifFile();
+  MassifFile(std::initializer_list<std::string_view> paths);
+  MassifFile(MassifFile &&other) noexcept;
+  MassifFile &operator=(MassifFile &&other) noexcept;
+  MassifFile(const MassifFile &) = delete;
+  MassifFile &operator=(const MassifFile &) = delete;
+  ~MassifFile();
+
+  // Write a SnapshotIndex next to the outputs
+  void setIndexOutput(bool enabled);
+  // Retention policies applied by write, append and writeTree
+  void setRetention(const Retention &retention);
+  // Drop snapshots whose body repeats an earlier one, and inputs that are the same file
+  void setDedup(bool enabled);
+  // Keep only the snapshots accepted by filter, set before adding inputs
+  void setFilter(const SnapshotFilter &filter);
+  // Write the snapshot bodies with copy_file_range from the input files instead of
+  // their mappings, which are dropped once parsed. Set before adding inputs, stream ignores it
+  void setPassthrough(bool enabled);
+  // Open and read many small inputs at once through io_uring, for network file systems.
+  // Warns and keeps the blocking reads when the build or the kernel lacks io_uring. With
+  // passthrough, the copies read are swapped for mappings of the inputs once parsed
+  void setIoUring(bool enabled);
+
+  /**
+   * @brief Add a massif file
+   * 
+   * @param path path to the massif file, gzip/zstd files are decompressed
+   * @return int 0 if success, or fails
+   */
+  int add(std::string_view path);
+
+  /**
+   * @brief Add massif files, in order
+   * 
+   * @param paths paths to the massif files
+   * @param jobs number of parser threads
+   * @return int 0 if success, or fails
+   */
+  int add(const std::vector<std::string> &paths, unsigned jobs = 1);
+
+  /**
+   * @brief With dedup, remove the inputs that are the same file as an earlier one
+   * 
+   * @param paths input paths, in argument order
+   * @return size_t number of inputs removed
+   */
+  size_t skipSameFiles(std::vector<std::string> &paths);
+
+  /**
+   * @brief Save the parsed state to a binary cache
+   * 
+   * @param path cache file path
+   * @return int 0 if success, or fails
+   */
+  int saveCache(std::string_view path);
+
+  /**
+   * @brief Replace the parsed state by a cache written by saveCache
+   * 
+   * @param path cache file path
+   * @return int 0 if success, or fails
+   */
+  int loadCache(std::string_view path);
+
+  /**
+   * @brief Write the snapshots sorted by time. A regular output is written next to path,
+   * synced and renamed over it, so after a crash path holds the old or the new content
+   * 
+   * @param path output path, compressed when ending in .gz or .zst
+   * @return int 0 if success, or fails
+   */
+  int write(std::string_view path);
+
+  /**
+   * @brief Add the snapshots to an existing output, the filter applies to the new
+   * snapshots only: the existing ones are all kept
+   * 
+   * @param path output path
+   * @return int 0 if success, or fails
+   */
+  int append(std::string_view path);
+
+  /**
+   * @brief Write one merged heap tree instead of the snapshots, a delta writes the
+   * sizes that shrank as 0 with their signed change after the node label
+   * 
+   * @param path output path
+   * @param mode "aggregate" or "delta:A:B"
+   * @return int 0 if success, or fails
+   */
+  int writeTree(std::string_view path, std::string_view mode);
+
+  /**
+   * @brief Merge inputs already ordered by time into path without loading them all,
+   * compressed inputs are decompressed a block at a time
+   * 
+   * @param paths paths to the massif files
+   * @param path output path
+   * @param jobs number of parser threads
+   * @return int 0 if success, or fails
+   */
+  int stream(const std::vector<std::string> &paths, std::string_view path, unsigned jobs = 1);
+
+  /**
+   * @brief Parse inputs once and write one output per process: the inputs with the same
+   * header lines (desc, cmd, time_unit) go to path with ".N" inserted before a .gz or .zst
+   * extension, N counting the groups from 0 in order of their first input
+   * 
+   * @param paths paths to the massif files
+   * @param path output path of the groups
+   * @param jobs number of parser threads, and of groups written at once
+   * @param outputs receives the output path of each group, if not null
+   * @return int 0 if success, or fails
+   */
+  int writeGroups(const std::vector<std::string> &paths, std::string_view path, unsigned jobs = 1, std::vector<std::string> *outputs = nullptr);
+
+  /**
+   * @brief Parse inputs one after the other and hand their snapshots to visitor,
+   * nothing is kept besides the counters of stats(). With dedup, a snapshot whose
+   * body hashes like an earlier one is skipped, the earlier bodies are not kept to compare
+   * 
+   * @param paths paths to the massif files
+   * @param visitor receives the header lines and snapshots
+   * @return int 0 if success, or fails
+   */
+  int visit(const std::vector<std::string> &paths, SnapshotVisitor &visitor);
+
+  // Header lines of the first input having some
+  const std::vector<std::string> &headers() const;
+  // Snapshots added, sorted by time once written
+  const std::vector<Snapshot> &snapshots() const;
+  // Lines of a snapshot of snapshots()
+  std::string_view body(const Snapshot &snapshot) const;
+  Stats &stats();
+  const Stats &stats() const;
+
+private:
+  class Impl;
+  std::unique_ptr<Impl> impl;
+};
+
+/**
+ * @brief Print snapshots of a combined massif file found through its index, without parsing it
+ * 
+ * @param path combined massif file path
+ * @param query "peak" for the snapshot using the most memory, "FROM:TO" for a time range, either bound may be empty
+ * @return int 0 if success, or fails
+ */
+int queryIndex(std::string_view path, std::string_view query);
+
+bool fileExists(std::string_view file);
+
+/**
+ * @brief Delete files, in batches per directory on a few threads
+ * 
+ * @param files paths to delete
+ * @param verbose print each path
+ * @return bool true if every file was deleted
+ */
+bool deleteFiles(const std::vector<std::string> &files, bool verbose = false);
+
+/**
+ * @brief Add the files matching a pattern, sorted by name
+ * 
+ * @param files filled with the matching paths
+ * @param pattern path with * ? [ wildcards, in the file name or directory names
+ * @return int 0 if success, or fails
+ */
+int listFile(std::vector<std::string> &files, std::string_view pattern);
+
+#endif
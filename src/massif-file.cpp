@@ -0,0 +1,1571 @@
+// libmassif-combine: MassifFile and the helpers declared in massif-combine.h
+#include "massif-internal.h"
+
+#include <dirent.h>
+#include <fnmatch.h>
+#include <glob.h>
+
+// Peak resident memory of the process in kB
+long Stats::peakMemory() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+void Stats::print(std::ostream &out) const {
+  out << "Files: " << files << "  Chunks: " << chunks << "  Bytes: " << bytes << std::endl;
+  out << "Lines: header " << headerLines << ", mark " << markLines << ", name " << nameLines
+      << ", content " << contentLines << ", other " << otherLines << std::endl;
+  out << "Snapshots: kept " << kept << ", dropped " << dropped << ", filtered " << filtered
+      << ", duplicates " << duplicates << std::endl;
+  if (skipped > 0) {
+    out << "Skipped: " << skipped << " files" << std::endl;
+  }
+  out << "Time: list " << listTime << "s, parse " << parseTime << "s, sort " << sortTime
+      << "s, write " << writeTime << "s" << std::endl;
+  out << "Peak memory: " << peakMemory() << " kB" << std::endl;
+}
+
+void Stats::printJson(std::ostream &out) const {
+  out << "{\"files\": " << files << ", \"chunks\": " << chunks << ", \"bytes\": " << bytes
+      << ", \"lines\": {\"header\": " << headerLines << ", \"mark\": " << markLines
+      << ", \"name\": " << nameLines << ", \"content\": " << contentLines << ", \"other\": " << otherLines
+      << "}, \"snapshots\": {\"kept\": " << kept << ", \"dropped\": " << dropped << ", \"filtered\": " << filtered
+      << ", \"duplicates\": " << duplicates << "}, \"skipped_files\": " << skipped << ", \"time_s\": {\"list\": " << listTime << ", \"parse\": " << parseTime
+      << ", \"sort\": " << sortTime << ", \"write\": " << writeTime
+      << "}, \"peak_rss_kb\": " << peakMemory() << "}" << std::endl;
+}
+
+class MassifFile::Impl {
+public:
+  StringList headers;
+  std::vector<Snapshot> snapshots;
+  // Mapped input files, snapshot lines point into them
+  std::vector<std::unique_ptr<MappedFile>> sources;
+  Stats stats;
+  // Write a SnapshotIndex next to the output
+  bool indexOutput = false;
+  Retention retention;
+  // Drop snapshots whose body repeats an earlier one, and inputs that are the same file
+  bool dedup = false;
+  SnapshotFilter filter;
+  // Copy the bodies from the input files in the kernel, see OutputFile::copy
+  bool passthrough = false;
+  // Read the inputs ahead through an InputRing
+  bool ioUring = false;
+
+public:
+  /**
+   * @brief Add a massif files to this class
+   * 
+   * @param paths path to massif files
+   * @return int 0 if success, or fails
+   */
+  int add(const StringList &paths) {
+    return add(paths.begin(), paths.end());
+  }
+
+  /**
+   * @brief Add a massif files to this class, parsing them on a thread pool
+   * 
+   * @param paths path to massif files
+   * @param jobs number of parser threads
+   * @return int 0 if success, or fails
+   */
+  int add(const StringList &paths, unsigned jobs) {
+    return add(paths.begin(), paths.end(), jobs);
+  }
+
+  template <class It>
+  int add(It first, It last) {
+    std::vector<std::string> paths;
+    std::unique_ptr<InputRing> ring = openRing(first, last, paths);
+    int ret = 0, r;
+    size_t i = 0;
+    for (auto it = first; it != last; ++it, i++) {
+      auto ahead = std::next(it);
+      if (ahead != last && !filter.hasWindow() && ring == nullptr) {
+        MappedFile::prefetch(*ahead); // read while this one is parsed, unless it may be skipped
+      }
+      if ((r = appendFile(*it, headers.size() > 0, ring != nullptr ? ring->take(i) : nullptr)) != 0) {
+        ret = r;
+      };
+    }
+
+    return ret;
+  }
+
+  template <class It>
+  int add(It first, It last, unsigned jobs) {
+    if (jobs <= 1) {
+      return add(first, last);
+    }
+
+    Clock::time_point start = Clock::now();
+    std::vector<std::string> paths(first, last);
+    std::vector<ParsedFile> parsed(paths.size());
+    std::vector<int> results = parseAll(paths, parsed, jobs);
+
+    // Merge in argument order so the result matches the serial path
+    int ret = 0;
+    for (size_t i = 0; i < parsed.size(); i++) {
+      merge(parsed[i]);
+      if (results[i] != 0) {
+        ret = results[i];
+      }
+    }
+
+    stats.parseTime += secondsSince(start);
+    return ret;
+  }
+
+  /**
+   * @brief Parse inputs once and combine them per process: inputs with the same header
+   * lines (desc, cmd, time_unit) form a group, written to path with the group number
+   * inserted before its compression extension, numbered in order of first input.
+   * The groups are written on jobs threads, each one like write does
+   * 
+   * @param paths path to massif files
+   * @param path output path of the groups
+   * @param jobs number of parser and writer threads
+   * @param outputs receives the output path of each group, if not null
+   * @return int 0 if success, or fails
+   */
+  int writeGroups(const StringList &paths, const std::string &path, unsigned jobs, StringList *outputs) {
+    Clock::time_point start = Clock::now();
+    std::vector<ParsedFile> parsed(paths.size());
+    std::vector<int> results = parseAll(paths, parsed, jobs);
+
+    int ret = 0;
+    std::vector<std::unique_ptr<Impl>> groups;
+    std::unordered_map<std::string, size_t> groupOf; // header lines joined by newlines
+    for (size_t i = 0; i < parsed.size(); i++) {
+      if (results[i] != 0) {
+        ret = results[i];
+      }
+      if (parsed[i].headers.empty() && parsed[i].snapshots.empty()) {
+        stats.merge(parsed[i].stats);
+        continue;
+      }
+
+      std::string key;
+      for (auto &line : parsed[i].headers) {
+        key += line;
+        key += '\n';
+      }
+      auto found = groupOf.emplace(key, groups.size());
+      if (found.second) {
+        groups.emplace_back(new Impl());
+        Impl &group = *groups.back();
+        group.indexOutput = indexOutput;
+        group.retention = retention;
+        group.dedup = dedup;
+        group.filter = filter;
+        group.passthrough = passthrough;
+      }
+      groups[found.first->second]->merge(parsed[i]);
+    }
+    stats.parseTime += secondsSince(start);
+    if (groups.empty()) {
+      std::cerr << "WARN: No content, exit" << std::endl;
+      return -1;
+    }
+
+    start = Clock::now();
+    std::vector<int> written(groups.size(), 0);
+    std::atomic<size_t> next(0);
+    auto writer = [&]() {
+      for (size_t g; (g = next++) < groups.size();) {
+        written[g] = groups[g]->write(suffixPathOf(path, "." + std::to_string(g)));
+      }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < jobs && i < groups.size(); i++) {
+      threads.emplace_back(writer);
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+
+    for (size_t g = 0; g < groups.size(); g++) {
+      stats.merge(groups[g]->stats);
+      stats.sortTime += groups[g]->stats.sortTime;
+      if (written[g] != 0) {
+        ret = written[g];
+      }
+      if (outputs != nullptr) {
+        outputs->push_back(suffixPathOf(path, "." + std::to_string(g)));
+      }
+    }
+    stats.writeTime += secondsSince(start);
+    return ret;
+  }
+
+  /**
+   * @brief With dedup, remove the inputs that are the same file as an earlier one before
+   * they are read: same device and inode, or same size and content
+   * 
+   * @param paths input paths, in argument order
+   * @return size_t number of inputs removed
+   */
+  size_t skipSameFiles(std::vector<std::string> &paths) {
+    if (!dedup) return 0;
+
+    std::map<std::pair<uint64_t, uint64_t>, size_t> inodes;
+    std::map<uint64_t, std::vector<size_t>> sizes;  // kept inputs by size
+    std::map<size_t, uint64_t> hashes;               // content hash of kept inputs, when needed
+    auto contentHash = [&](size_t i) {
+      auto it = hashes.find(i);
+      if (it != hashes.end()) return it->second;
+      MappedFile file;
+      uint64_t hash = file.open(paths[i]) == 0 ? hashBytes(file.data(), file.size()) : i; // unreadable differs
+      hashes[i] = hash;
+      return hash;
+    };
+    auto sameContent = [&](size_t i, size_t j) {
+      MappedFile a, b;
+      return a.open(paths[i]) == 0 && b.open(paths[j]) == 0 && a.size() == b.size()
+          && (a.size() == 0 || memcmp(a.data(), b.data(), a.size()) == 0);
+    };
+
+    std::vector<bool> keep(paths.size(), true);
+    for (size_t i = 0; i < paths.size(); i++) {
+      struct stat buf;
+      if (stat(paths[i].c_str(), &buf) != 0) continue; // reported when parsed
+
+      auto inode = inodes.emplace(std::make_pair((uint64_t)buf.st_dev, (uint64_t)buf.st_ino), i);
+      size_t same = inode.first->second;
+      if (inode.second) {
+        auto &bySize = sizes[buf.st_size];
+        for (size_t j : bySize) {
+          if (contentHash(j) == contentHash(i) && sameContent(i, j)) {
+            same = j;
+            break;
+          }
+        }
+        if (same == i) {
+          bySize.push_back(i);
+          continue;
+        }
+      }
+
+      std::cerr << "WARN: " << paths[i] << " is the same file as " << paths[same] << ", skipped" << std::endl;
+      keep[i] = false;
+    }
+
+    size_t before = paths.size(), i = 0;
+    auto last = std::remove_if(paths.begin(), paths.end(),
+          [&](const std::string &) { return !keep[i++]; });
+    paths.erase(last, paths.end());
+    stats.skipped += before - paths.size();
+    return before - paths.size();
+  }
+
+  /**
+   * @brief Add a massif file to this class
+   * 
+   * @param path path to massif file
+   * @return int 0 if success, or fails
+   */
+  int add(const std::string &path) {
+    return appendFile(path, headers.size() > 0);
+  }
+
+  /**
+   * @brief Save the parsed state to a binary cache file, which loadCache maps back
+   * without parsing. The snapshots are sorted and their bodies copied in output order
+   * behind the records, so the text writer reads the cache like any input
+   * 
+   * @param path cache file path, written aside then renamed
+   * @return int 0 if success, or fails
+   */
+  int saveCache(const std::string &path) {
+    sortSnapshots();
+    Clock::time_point start = Clock::now();
+
+    CacheHeader header;
+    memcpy(header.magic, "MSFCACHE", sizeof(header.magic));
+    header.version = CACHE_VERSION;
+    header.recordSize = sizeof(Snapshot);
+    header.count = snapshots.size();
+    header.headerBytes = 0;
+    header.bodyBytes = 0;
+    for (auto &line : headers) {
+      header.headerBytes += line.size() + 1;
+    }
+    for (auto &snapshot : snapshots) {
+      header.bodyBytes += snapshot.length;
+    }
+
+    std::string temp = tempPathOf(path);
+    OutputFile file(temp);
+    if (!file) return 1; // Error open file
+
+    // Records point into the cache itself, numbered to keep the sorted order
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    uint64_t offset = sizeof(header) + snapshots.size() * sizeof(Snapshot) + header.headerBytes;
+    for (size_t i = 0; i < snapshots.size(); i++) {
+      Snapshot record = snapshots[i];
+      if (record.hash == 0) {
+        const char *data = body(record);
+        record.hash = (uint32_t)hashBytes(data, bodyLength(data, record.length));
+      }
+      record.offset = offset;
+      record.source = 0;
+      record.index = i;
+      record.flags &= SNAPSHOT_NEWLINE; // the cache holds the bodies only
+      offset += record.length;
+      file.write(reinterpret_cast<const char *>(&record), sizeof(record));
+    }
+    writeList(file, headers);
+    for (auto &snapshot : snapshots) {
+      file.write(body(snapshot), snapshot.length);
+    }
+    file.close(true);
+    if (!file) {
+      unlink(temp.c_str());
+      return 2; // Error write file
+    }
+    if (replaceFile(temp, path, false) != 0) return 3; // Error replace file
+    stats.writeTime += secondsSince(start);
+    return 0;
+  }
+
+  /**
+   * @brief Add the parsed state saved by saveCache, the cache is mapped and only the
+   * snapshot records are copied: they join the snapshots of the other inputs, which are
+   * sorted, filtered and retained together. The bodies are read from the mapping
+   * 
+   * @param path cache file path
+   * @return int 0 if success, or fails
+   */
+  int loadCache(const std::string &path) {
+    Clock::time_point start = Clock::now();
+    std::unique_ptr<MappedFile> file(new MappedFile());
+    if (file->open(path) != 0) return 1; // Error open file
+
+    CacheHeader header;
+    if (file->size() < sizeof(header)) return 2; // Not a cache
+    memcpy(&header, file->data(), sizeof(header));
+    if (memcmp(header.magic, "MSFCACHE", sizeof(header.magic)) != 0
+        || header.version != CACHE_VERSION || header.recordSize != sizeof(Snapshot)
+        || file->size() != sizeof(header) + header.count * sizeof(Snapshot) + header.headerBytes + header.bodyBytes) {
+      return 2; // Not a cache, another version or truncated
+    }
+
+    // The first headers found are kept, as when merging parsed files
+    const char *lines = file->data() + sizeof(header) + header.count * sizeof(Snapshot);
+    const char *end = lines + header.headerBytes;
+    StringList list;
+    while (lines < end) {
+      const char *eol = static_cast<const char *>(memchr(lines, '\n', end - lines));
+      if (eol == nullptr) eol = end;
+      list.push_back(std::string(lines, eol - lines));
+      lines = eol + 1;
+    }
+    if (headers.empty()) {
+      headers = std::move(list);
+    }
+
+    size_t first = snapshots.size();
+    const Snapshot *records = reinterpret_cast<const Snapshot *>(file->data() + sizeof(header));
+    if (filter.enabled()) {
+      std::copy_if(records, records + header.count, std::back_inserter(snapshots),
+                   [&](const Snapshot &snapshot) { return filter.accepts(snapshot); });
+      stats.filtered += header.count - (snapshots.size() - first);
+    } else {
+      snapshots.insert(snapshots.end(), records, records + header.count);
+    }
+    uint32_t source = sources.size();
+    if (source != 0) {
+      for (size_t i = first; i < snapshots.size(); i++) {
+        snapshots[i].source = source;
+      }
+    }
+    file->discard(sizeof(header) + header.count * sizeof(Snapshot)); // the records are not read again
+    sources.push_back(std::move(file));
+
+    stats.files++;
+    stats.kept += snapshots.size() - first;
+    stats.parseTime += secondsSince(start);
+    return 0;
+  }
+
+  /**
+   * @brief Body lines of a snapshot, read from its input only when used
+   * 
+   * @param snapshot snapshot of this class
+   * @return const char* start of the body, snapshot.length bytes long
+   */
+  const char *body(const Snapshot &snapshot) const {
+    return sources[snapshot.source]->data() + snapshot.offset;
+  }
+
+  /**
+   * @brief Write whole content to a new massif file. It is written aside and synced,
+   * then renamed over path, so path holds either the old or the new content
+   * 
+   * @param path new massif file path
+   * @return int 0 if success, or fails
+   */
+  int write(const std::string &path) {
+    return writeAside(path, indexOutput, [&](const std::string &output) { return writeFile(output); });
+  }
+
+  // Write whole content to path itself
+  int writeFile(const std::string &path) {
+    if (headers.size() <= 0 && snapshots.size() <=0) {
+      std::cerr << "WARN: No content, exit" << std::endl;
+      return -1;
+    }
+
+    sortSnapshots();
+    removeDuplicates();
+    retain();
+
+    Clock::time_point start = Clock::now();
+    OutputFile file(path);
+    if (!file) return 1; // Error open file
+
+    // Write header
+    writeList(file, headers);
+    if (!file) return 2; // Error write file
+
+    // Write snapshot
+    records.clear();
+    if (!writeSnapshots(file, 0)) return 2; // Error write file
+    file.close(true);
+    if (!file) return 3; // Error close file
+
+    if (indexOutput && SnapshotIndex::write(SnapshotIndex::pathOf(path), records) != 0) {
+      return 4; // Error write index
+    }
+    stats.writeTime += secondsSince(start);
+    return 0;
+  }
+
+  /**
+   * @brief Add the snapshots to an existing combined massif file. When all of them
+   * are later than its last snapshot only that snapshot is read and the new ones are
+   * appended, otherwise the file is merged and rewritten, and so is a file whose index
+   * is missing or stale with an index wanted. A compressed file is decompressed through
+   * to find its last snapshot, keeping only that one in memory
+   * 
+   * @param path combined massif file path, written from scratch if missing
+   * @return int 0 if success, or fails
+   */
+  int append(const std::string &path) {
+    MappedFile existing;
+    if (existing.open(path, true) != 0) {
+      return write(path);
+    }
+    if (!existing.complete()) {
+      readToLastSnapshot(existing);
+    }
+    if (existing.result() != 0 || existing.size() == 0) {
+      return write(path);
+    }
+
+    uint64_t lastTime;
+    size_t count = SnapshotReader::findLastSnapshot(existing, lastTime);
+    sortSnapshots();
+    removeDuplicates();
+    retain();
+    if (snapshots.empty()) return 0; // nothing new
+
+    // An index is appended to when it holds the existing snapshots, else a merge rebuilds it
+    std::string index = SnapshotIndex::pathOf(path);
+    bool indexed = !indexOutput || indexHolds(index, path, count, existing.size());
+
+    // With --dedup, snapshots at lastTime may repeat existing ones, which only a merge finds
+    if (indexed && (count == 0 || snapshots.front().time > lastTime || (!dedup && snapshots.front().time == lastTime))) {
+      Clock::time_point start = Clock::now();
+      OutputFile file(path, true);
+      if (!file) return 1; // Error open file
+      file.startAt(existing.size());
+
+      if (existing.data()[existing.size() - 1] != '\n') {
+        file.put('\n');
+      }
+      records.clear();
+      if (!writeSnapshots(file, count)) return 2; // Error write file
+      file.close(true);
+      if (!file) return 3; // Error close file
+
+      if (indexOutput && SnapshotIndex::append(index, count, records) != 0) {
+        std::cerr << "WARN: cannot update " << index << ", removed" << std::endl;
+        unlink(index.c_str());
+      }
+      stats.writeTime += secondsSince(start);
+      return 0;
+    }
+
+    // Older snapshots arrived, merge with the existing ones which go first on ties.
+    // The filter picked the new snapshots, the existing ones are all kept
+    ParsedFile parsed;
+    Clock::time_point start = Clock::now();
+    int ret = parseFile(path, parsed, true, dedup, SnapshotFilter());
+    stats.parseTime += secondsSince(start);
+    if (ret != 0) return ret;
+
+    stats.merge(parsed.stats);
+    if (!parsed.headers.empty()) {
+      headers = std::move(parsed.headers);
+    }
+    for (auto &snapshot : snapshots) {
+      snapshot.source++;
+    }
+    sources.insert(sources.begin(), std::move(parsed.source));
+    snapshots.insert(snapshots.end(), parsed.snapshots.begin(), parsed.snapshots.end());
+
+    // The existing file stays mapped, written aside it is replaced once complete
+    return write(path);
+  }
+
+  /**
+   * @brief Write a massif file with one snapshot holding a tree merged by call path from
+   * the parsed heap trees: "aggregate" sums every detailed and peak snapshot, "delta:A:B"
+   * is snapshot B minus snapshot A, numbered as in the combined output. A delta stays
+   * readable by ms_print: mem_heap_B and the nodes that shrank are written as 0, the nodes
+   * with their signed change after the label
+   * 
+   * @param path new massif file path
+   * @param mode "aggregate" or "delta:A:B"
+   * @return int 0 if success, or fails
+   */
+  int writeTree(const std::string &path, const std::string &mode) {
+    return writeAside(path, false, [&](const std::string &output) { return writeTreeFile(output, mode); });
+  }
+
+  // Write the merged tree to path itself
+  int writeTreeFile(const std::string &path, const std::string &mode) {
+    sortSnapshots();
+    removeDuplicates();
+    retain();
+
+    StringTable table;
+    MergedTree merged;
+    std::vector<TreeNode> tree;
+    uint64_t time = 0;
+    long long heap = 0;
+    if (mode == "aggregate") {
+      for (auto &snapshot : snapshots) {
+        if (!isProtected(snapshot)) continue;
+        parseHeapTree(body(snapshot), snapshot.length, table, tree);
+        merged.add(tree, 1);
+        time = snapshot.time;
+      }
+      heap = merged.total();
+    } else if (mode.compare(0, 6, "delta:") == 0) {
+      size_t a, b;
+      if (sscanf(mode.c_str() + 6, "%zu:%zu", &a, &b) != 2 || a >= snapshots.size() || b >= snapshots.size()) {
+        std::cerr << "WARN: " << mode << " needs two snapshots below " << snapshots.size() << std::endl;
+        return -1;
+      }
+      parseHeapTree(body(snapshots[a]), snapshots[a].length, table, tree);
+      merged.add(tree, -1);
+      parseHeapTree(body(snapshots[b]), snapshots[b].length, table, tree);
+      merged.add(tree, 1);
+      time = snapshots[b].time;
+      // Never below the top level nodes, which are raised to the sum of their children
+      heap = std::max<long long>(merged.total(), (long long)snapshots[b].memHeap - (long long)snapshots[a].memHeap);
+    } else {
+      std::cerr << "WARN: unknown tree mode " << mode << std::endl;
+      return -1;
+    }
+
+    OutputFile file(path);
+    if (!file) return 1; // Error open file
+
+    writeList(file, headers);
+    char title[160];
+    int len = snprintf(title, sizeof(title), "#-----------\nsnapshot=0\n#-----------\ntime=%llu\n"
+                       "mem_heap_B=%lld\nmem_heap_extra_B=0\nmem_stacks_B=0\nheap_tree=detailed\n",
+                       (unsigned long long)time, heap);
+    file.write(title, len);
+    merged.write(file, table);
+    file.close(true);
+    if (!file) return 2; // Error write file
+    return 0;
+  }
+
+  /**
+   * @brief Merge massif files into a new massif file without loading them all.
+   * Each input is a run sorted by time, the runs are k-way merged so only a few
+   * pending snapshots per input are kept in memory. Workers parse the inputs ahead
+   * of the merge and a writer thread drains the merged snapshots, so reading,
+   * parsing and writing overlap
+   * 
+   * @param paths path to massif files
+   * @param path new massif file path, replaced like write does
+   * @param jobs number of parser threads
+   * @return int 0 if success, or fails
+   */
+  int stream(const StringList &paths, const std::string &path, unsigned jobs = 1) {
+    return writeAside(path, indexOutput, [&](const std::string &output) { return streamFile(paths, output, jobs); });
+  }
+
+  // Merge the inputs into path itself
+  int streamFile(const StringList &paths, const std::string &path, unsigned jobs) {
+    typedef std::pair<uint64_t, size_t> Pending; // snapshot time, input index
+    typedef struct {
+      Snapshot snapshot;
+      size_t input;
+      bool last;      // the input can be unmapped once written
+    } Merged;
+    typedef std::vector<Merged> MergedBatch;
+    const size_t MERGED_BATCH = 64;
+
+    ReadAhead inputs(paths, jobs, filter);
+    std::vector<Snapshot> pending(paths.size());
+    std::priority_queue<Pending, std::vector<Pending>, std::greater<Pending>> queue;
+
+    // Wait for the first snapshot of each input, the headers come from the first input having some
+    for (size_t input = 0; input < paths.size(); input++) {
+      bool found = inputs.next(input, pending[input]);
+      if (found) {
+        queue.push(Pending(pending[input].time, input));
+      }
+      SnapshotReader *reader = inputs.reader(input);
+      if (reader != nullptr && headers.empty()) {
+        headers = std::move(reader->headers);
+      }
+      if (reader != nullptr && !found) {
+        stats.merge(reader->stats); // never popped
+        inputs.release(input);
+      }
+    }
+
+    if (headers.size() <= 0 && queue.empty()) {
+      std::cerr << "WARN: No content, exit" << std::endl;
+      return -1;
+    }
+
+    OutputFile file(path);
+    if (!file) return 1; // Error open file
+
+    // Write header
+    writeList(file, headers);
+    if (!file) return 2; // Error write file
+
+    // The writer thread owns file and records until joined
+    records.clear();
+    BoundedQueue<MergedBatch> merged(16);
+    std::atomic<bool> failed(false);
+    double writeTime = 0;
+    std::thread writer([&]() {
+      MergedBatch batch;
+      size_t i = 0;
+      while (merged.pop(batch)) {
+        Clock::time_point start = Clock::now();
+        for (auto &item : batch) {
+          SnapshotReader &reader = *inputs.reader(item.input);
+          writeSnapshot(file, i++, reader.source().data() + item.snapshot.offset, item.snapshot);
+          reader.source().discard(item.snapshot.offset + item.snapshot.length);
+          if (item.last) {
+            inputs.release(item.input);
+          }
+        }
+        writeTime += secondsSince(start);
+        if (!file) {
+          failed = true;
+          merged.close();
+        }
+      }
+    });
+
+    // Hand the earliest pending snapshot to the writer, then refill from the same input
+    MergedBatch batch;
+    while (!queue.empty() && !failed) {
+      size_t input = queue.top().second;
+      queue.pop();
+
+      Snapshot snapshot = pending[input];
+      bool found = inputs.next(input, pending[input]);
+      if (found) {
+        if (pending[input].time < snapshot.time) {
+          std::cerr << "WARN: " << paths[input] << " is not ordered by time" << std::endl;
+        }
+        queue.push(Pending(pending[input].time, input));
+      } else {
+        stats.merge(inputs.reader(input)->stats);
+      }
+
+      batch.push_back({snapshot, input, !found});
+      if (batch.size() == MERGED_BATCH) {
+        merged.push(std::move(batch));
+        batch.clear();
+      }
+    }
+    if (!batch.empty()) {
+      merged.push(std::move(batch));
+    }
+    merged.close();
+    writer.join();
+    if (failed) return 2; // Error write file
+
+    file.close(true);
+    if (!file) return 3; // Error close file
+
+    if (indexOutput && SnapshotIndex::write(SnapshotIndex::pathOf(path), records) != 0) {
+      return 4; // Error write index
+    }
+
+    stats.parseTime += inputs.parseTime();
+    stats.writeTime += writeTime;
+    return 0;
+  }
+
+  /**
+   * @brief Parse inputs one after the other and hand their snapshots to visitor
+   * 
+   * @param paths path to massif files
+   * @param visitor receives the header lines and snapshots
+   * @return int 0 if success, or fails
+   */
+  int visit(const StringList &paths, SnapshotVisitor &visitor) {
+    Clock::time_point start = Clock::now();
+    int ret = 0;
+    bool more = true;
+    // With dedup, 64-bit hashes of the bodies seen: the inputs before are unmapped
+    std::unordered_set<uint64_t> seen;
+    for (size_t i = 0; i < paths.size() && more; i++) {
+      if (i + 1 < paths.size()) {
+        MappedFile::prefetch(paths[i + 1]); // read while this one is parsed
+      }
+      SnapshotReader reader;
+      int r = reader.open(paths[i], true, false);
+      if (r != 0) {
+        ret = r;
+        continue;
+      }
+      reader.setFilter(filter);
+
+      // Header lines are handed over as soon as the reader collected them
+      auto flushHeaders = [&]() {
+        for (auto &line : reader.headers) {
+          visitor.header(i, line);
+        }
+        reader.headers.clear();
+      };
+      Snapshot snapshot;
+      while (more && reader.next(snapshot)) {
+        flushHeaders();
+        snapshot.source = i;
+        const char *body = reader.source().data() + snapshot.offset;
+        if (dedup) {
+          uint64_t hash = hashBytes(body, bodyLength(body, snapshot.length));
+          if (!seen.insert(hash).second) {
+            stats.duplicates++;
+            continue;
+          }
+          snapshot.hash = (uint32_t)hash;
+        }
+        more = visitor.snapshot(i, snapshot, std::string_view(body, snapshot.length));
+        reader.source().discard(snapshot.offset + snapshot.length); // a compressed input is freed as it is read
+      }
+      flushHeaders();
+
+      stats.merge(reader.stats);
+      if (reader.result() != 0) {
+        ret = reader.result();
+      }
+    }
+
+    stats.parseTime += secondsSince(start);
+    return ret;
+  }
+
+private:
+  static const uint32_t CACHE_VERSION = 2;
+  static const size_t CHUNK_BYTES = 16 << 20;   // smallest chunk of a file parsed by one thread
+
+  // Index records of the snapshots written by the last write
+  std::vector<IndexRecord> records;
+
+  // Whether the index of a combined file holds its count snapshots and ends with it, so
+  // records can be appended to it. A missing index is not, quietly
+  static bool indexHolds(const std::string &index, const std::string &path, size_t count, size_t size) {
+    SnapshotIndex existing;
+    int ret = existing.open(index);
+    if (ret == 0 && existing.size() == count && (count == 0 || existing.matches(size))) return true;
+    if (ret != 1) {
+      std::cerr << "WARN: " << index << " does not match " << path << ", rebuilt" << std::endl;
+    }
+    return false;
+  }
+
+  // Decompress a streamed file to its end, its pages are dropped up to its last snapshot
+  // start: findLastSnapshot reads back to there
+  static void readToLastSnapshot(MappedFile &file) {
+    size_t tail = 0, scanned = 0;
+    do {
+      // Starts with their three lines decompressed, the starts after are looked for again
+      const char *data = file.data();
+      size_t size = file.size(), whole = size;
+      for (int n = 0; n < 3 && whole > scanned; n++) {
+        const char *eol = static_cast<const char *>(memrchr(data + scanned, '\n', whole - scanned));
+        whole = eol == nullptr ? scanned : eol - data;
+      }
+      size_t start;
+      while ((start = SnapshotReader::findSnapshotStart(file, scanned)) <= whole && start < size) {
+        tail = scanned = start;
+      }
+      scanned = std::max(scanned, whole);
+      file.discard(tail);
+    } while (file.more());
+  }
+
+  // Sort snapshots by time, ties keep input file order then snapshot order
+  void sortSnapshots() {
+    Clock::time_point start = Clock::now();
+    auto less = [](const Snapshot &a, const Snapshot &b) -> bool {
+      return std::tie(a.time, a.source, a.index) < std::tie(b.time, b.source, b.index);
+    };
+    // Loaded caches and ordered inputs are sorted already
+    if (!std::is_sorted(snapshots.begin(), snapshots.end(), less)) {
+      std::sort(snapshots.begin(), snapshots.end(), less);
+    }
+    stats.sortTime += secondsSince(start);
+  }
+
+  // Detailed and peak snapshots are never dropped by retention
+  static bool isProtected(const Snapshot &snapshot) {
+    return snapshot.heapTree == HEAP_TREE_DETAILED || snapshot.heapTree == HEAP_TREE_PEAK;
+  }
+
+  // With --dedup, drop the sorted snapshots whose body is the same as an earlier one.
+  // Equal bodies have equal times, so only runs of equal times are compared
+  void removeDuplicates() {
+    if (!dedup) return;
+    size_t before = snapshots.size();
+    std::vector<bool> keep(snapshots.size(), true);
+    std::unordered_map<uint64_t, std::vector<size_t>> seen; // hash and length, kept snapshots
+    for (size_t first = 0, last; first < snapshots.size(); first = last) {
+      last = first + 1;
+      while (last < snapshots.size() && snapshots[last].time == snapshots[first].time) last++;
+      if (last - first == 1) continue;
+
+      seen.clear();
+      for (size_t i = first; i < last; i++) {
+        const char *data = body(snapshots[i]);
+        size_t length = bodyLength(data, snapshots[i].length);
+        auto &same = seen[(uint64_t)snapshots[i].hash << 32 ^ length];
+        for (size_t j : same) {
+          if (length == bodyLength(body(snapshots[j]), snapshots[j].length)
+              && memcmp(data, body(snapshots[j]), length) == 0) {
+            keep[i] = false;
+            break;
+          }
+        }
+        if (keep[i]) same.push_back(i);
+      }
+    }
+
+    size_t i = 0;
+    auto last = std::remove_if(snapshots.begin(), snapshots.end(),
+          [&](const Snapshot &) { return !keep[i++]; });
+    snapshots.erase(last, snapshots.end());
+    stats.duplicates += before - snapshots.size();
+  }
+
+  // Apply the retention policies to the sorted snapshots
+  void retain() {
+    if (!retention.enabled()) return;
+    size_t before = snapshots.size();
+
+    // Per time bucket, keep the protected snapshots and the largest other one
+    if (retention.bucket > 0) {
+      std::vector<bool> keep(snapshots.size(), false);
+      size_t best = SIZE_MAX;
+      for (size_t i = 0; i < snapshots.size(); i++) {
+        if (i > 0 && snapshots[i].time / retention.bucket != snapshots[i - 1].time / retention.bucket) {
+          best = SIZE_MAX; // new bucket
+        }
+        if (isProtected(snapshots[i])) {
+          keep[i] = true;
+        } else if (best == SIZE_MAX || snapshots[i].memHeap > snapshots[best].memHeap) {
+          if (best != SIZE_MAX) keep[best] = false;
+          keep[i] = true;
+          best = i;
+        }
+      }
+
+      size_t i = 0;
+      auto last = std::remove_if(snapshots.begin(), snapshots.end(),
+            [&](const Snapshot &) { return !keep[i++]; });
+      snapshots.erase(last, snapshots.end());
+    }
+
+    // Keep the other snapshots evenly spread over the remaining budget
+    size_t protectedCount = std::count_if(snapshots.begin(), snapshots.end(), isProtected);
+    if (retention.maxSnapshots > 0 && snapshots.size() > retention.maxSnapshots) {
+      size_t others = snapshots.size() - protectedCount;
+      size_t budget = retention.maxSnapshots > protectedCount ? retention.maxSnapshots - protectedCount : 0;
+      size_t j = 0;
+      auto last = std::remove_if(snapshots.begin(), snapshots.end(), [&](const Snapshot &snapshot) {
+        if (isProtected(snapshot)) return false;
+        bool keep = j * budget / others != (j + 1) * budget / others;
+        j++;
+        return !keep;
+      });
+      snapshots.erase(last, snapshots.end());
+    }
+
+    stats.filtered += before - snapshots.size();
+  }
+
+  // Parse the inputs on a pool of jobs threads, return the result of each one
+  std::vector<int> parseAll(const std::vector<std::string> &paths, std::vector<ParsedFile> &parsed, unsigned jobs) {
+    std::vector<int> results(paths.size(), 0);
+    std::atomic<size_t> next(0);
+    // Threads left over by fewer files than jobs split the files in chunks
+    unsigned chunkJobs = paths.size() < jobs ? jobs / std::max<size_t>(1, paths.size()) : 1;
+    std::vector<std::string> ringPaths;
+    std::unique_ptr<InputRing> ring = openRing(paths.begin(), paths.end(), ringPaths);
+    std::mutex ringMutex;
+
+    // Each worker takes the next unparsed file until none is left
+    auto worker = [&]() {
+      size_t i;
+      while ((i = next++) < paths.size()) {
+        std::unique_ptr<MappedFile> file;
+        if (ring != nullptr) {
+          std::lock_guard<std::mutex> lock(ringMutex);
+          file = ring->take(i);
+        } else if (i + jobs < paths.size() && !filter.hasWindow()) {
+          MappedFile::prefetch(paths[i + jobs]); // read while this one is parsed, unless it may be skipped
+        }
+        results[i] = parseFile(paths[i], parsed[i], true, dedup, filter, chunkJobs, std::move(file));
+        if (passthrough && parsed[i].source != nullptr) {
+          parsed[i].source->drop(); // the bodies are copied from the file
+        }
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < jobs && i < paths.size(); i++) {
+      threads.emplace_back(worker);
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+
+    return results;
+  }
+
+  // Ring reading the inputs ahead when enabled, the filter reads less of them without it
+  template <class It>
+  std::unique_ptr<InputRing> openRing(It first, It last, std::vector<std::string> &paths) {
+    std::unique_ptr<InputRing> ring;
+    if (!ioUring || filter.hasWindow()) return ring;
+    paths.assign(first, last);
+    ring.reset(new InputRing(paths));
+    if (!*ring) ring.reset();
+    return ring;
+  }
+
+  // Write an output with writeOutput to a synced file next to path, then rename it over
+  // path, its index too when indexed. Pipes, devices and links are written in place
+  template <typename WriteOutput>
+  int writeAside(const std::string &path, bool indexed, WriteOutput writeOutput) {
+    if (!isReplaceable(path)) return writeOutput(path);
+
+    std::string temp = tempPathOf(path);
+    int ret = writeOutput(temp);
+    if (ret != 0) {
+      unlink(temp.c_str());
+      if (indexed) unlink(SnapshotIndex::pathOf(temp).c_str());
+      return ret;
+    }
+    return replaceFile(temp, path, indexed);
+  }
+
+  // Write sorted snapshots, numbered from first
+  bool writeSnapshots(OutputFile &stream, size_t first) {
+    CopySource inputs;
+    for (size_t i = 0, last; i < snapshots.size(); i = last) {
+      last = runEnd(i, first);
+      const Snapshot &snapshot = snapshots[i];
+      writeRun(stream, first, i, last, passthrough ? inputs.of(*sources[snapshot.source]) : -1);
+      if (!stream) return false;
+    }
+    return true;
+  }
+
+  // End of the run of snapshots from i that follow each other in the same input, titled
+  // as in the output: an input numbered like the output, such as an output merged again
+  size_t runEnd(size_t i, size_t first) const {
+    size_t last = i + 1;
+    for (; last < snapshots.size(); last++) {
+      const Snapshot &prev = snapshots[last - 1], &next = snapshots[last];
+      char title[64];
+      if (next.source != prev.source || !(next.flags & SNAPSHOT_TITLED) || next.index != first + last
+          || next.offset != prev.offset + prev.length + SnapshotReader::formatTitle(title, first + last)) {
+        break;
+      }
+    }
+    return last;
+  }
+
+  // Write a string list to stream
+  void writeList(OutputFile &stream, StringList &list) {
+    for (auto &str : list) {
+      stream.write(str).put('\n');
+    }
+  }
+
+  // Write snapshots [i, last) of a run found by runEnd: the title of the first one, then
+  // the bodies and titles in between as one block, copied from the input file in when given
+  void writeRun(OutputFile &stream, size_t first, size_t i, size_t last, int in) {
+    const Snapshot &front = snapshots[i], &back = snapshots[last - 1];
+    char title[64];
+    stream.write(title, SnapshotReader::formatTitle(title, first + i));
+    uint64_t start = stream.offset() - front.offset; // input offset X is written at start + X, modulo 2^64
+    stream.copy(in, front.offset, body(front), back.offset + back.length - front.offset);
+    if (!(back.flags & SNAPSHOT_NEWLINE)) {
+      stream.put('\n'); // last line of the input had no newline
+    }
+
+    if (indexOutput) {
+      for (size_t j = i; j < last; j++) {
+        const Snapshot &snapshot = snapshots[j];
+        uint64_t offset = start + snapshot.offset - SnapshotReader::formatTitle(title, first + j);
+        uint64_t end = j + 1 < last ? start + snapshot.offset + snapshot.length : stream.offset();
+        records.push_back({ offset, end - offset, snapshot.time, snapshot.memHeap, snapshot.memHeapExtra,
+                            snapshot.memStacks, snapshot.heapTree, {0} });
+      }
+    }
+  }
+
+  // Write snapshot header and content, the body is copied from the input file in when given
+  void writeSnapshot(OutputFile &stream, size_t index, const char *body, const Snapshot &snapshot, int in = -1) {
+    if (indexOutput) {
+      IndexRecord record = { stream.offset(), 0, snapshot.time, snapshot.memHeap,
+                             snapshot.memHeapExtra, snapshot.memStacks, snapshot.heapTree, {0} };
+      records.push_back(record);
+    }
+
+    char title[64];
+    int len = SnapshotReader::formatTitle(title, index);
+    stream.write(title, len);
+
+    stream.copy(in, snapshot.offset, body, snapshot.length);
+    if (!(snapshot.flags & SNAPSHOT_NEWLINE)) {
+      stream.put('\n'); // last line of the input had no newline
+    }
+
+    if (indexOutput) {
+      records.back().length = stream.offset() - records.back().offset;
+    }
+  }
+
+  // Read massif output file and append snapshot
+  int appendFile(const std::string &path, bool ignore_header = true, std::unique_ptr<MappedFile> file = nullptr) {
+    Clock::time_point start = Clock::now();
+    ParsedFile parsed;
+    int ret = parseFile(path, parsed, !ignore_header, dedup, filter, 1, std::move(file));
+    merge(parsed);
+    stats.parseTime += secondsSince(start);
+    return ret;
+  }
+
+  // Move a parsed file into this class, the first headers found are kept
+  void merge(ParsedFile &parsed) {
+    stats.merge(parsed.stats);
+    if (headers.empty()) {
+      headers = std::move(parsed.headers);
+    }
+    if (parsed.source == nullptr) return;
+    if (passthrough) {
+      parsed.source->drop(); // the bodies are copied from the file
+    }
+
+    uint32_t source = sources.size();
+    sources.push_back(std::move(parsed.source));
+    for (auto &snapshot : parsed.snapshots) {
+      snapshot.source = source;
+      snapshots.push_back(snapshot);
+    }
+  }
+
+  // Part of an input file to parse, a filter can leave the rest of the file unread
+  typedef struct {
+    size_t begin;
+    size_t end;
+    size_t index;       // number of the first snapshot of the range in the file
+  } ParseRange;
+
+  // Ranges of a file that can hold snapshots passing filter. A combined file with a
+  // matching index is read only over the records passing it, a file whose time
+  // range misses the window only for its header lines
+  static std::vector<ParseRange> filterRanges(const std::string &path, const MappedFile &file,
+                                              const SnapshotFilter &filter) {
+    size_t size = file.size();
+    if (!filter.enabled()) return {{0, size, 0}};
+
+    // Only the index, the last snapshot and the header lines are read to decide
+    file.sequential(false);
+    struct Sequential {
+      const MappedFile &file;
+      ~Sequential() { file.sequential(true); }
+    } restore{file};
+
+    SnapshotIndex index;
+    if (index.open(SnapshotIndex::pathOf(path)) == 0 && index.matches(size)) {
+      const IndexRecord *records = index.records();
+      std::pair<size_t, size_t> window = index.range(filter.from, filter.to);
+      while (window.first < window.second && records[window.first].memHeap < filter.minHeap) window.first++;
+      while (window.first < window.second && records[window.second - 1].memHeap < filter.minHeap) window.second--;
+
+      std::vector<ParseRange> ranges = {{0, records[0].offset, 0}};
+      if (window.first < window.second) {
+        const IndexRecord &last = records[window.second - 1];
+        ranges.push_back({records[window.first].offset, last.offset + last.length, window.first});
+      }
+      return ranges;
+    }
+
+    if (SnapshotReader::missesWindow(file, filter)) {
+      return {{0, SnapshotReader::findSnapshotStart(file, 0), 0}};
+    }
+    return {{0, size, 0}};
+  }
+
+  // Read massif output file into parsed, touches no state of this class.
+  // With jobs > 1 a large file is cut into chunks on snapshot starts, parsed by one
+  // thread each and stitched back in order
+  static int parseFile(const std::string &path, ParsedFile &parsed, bool keep_header, bool hash_body,
+                       const SnapshotFilter &filter, unsigned jobs = 1, std::unique_ptr<MappedFile> file = nullptr) {
+    typedef struct {
+      size_t begin;
+      size_t end;
+      size_t index;     // number of the first snapshot, when not following the previous chunk
+      bool follows;     // continues the previous chunk of the same range
+    } Chunk;
+
+    if (file == nullptr) {
+      file.reset(new MappedFile());
+      if (file->open(path) != 0) return 1; // error open file
+    }
+
+    size_t size = file->size();
+    std::vector<ParseRange> ranges = filterRanges(path, *file, filter);
+    auto split = [&](unsigned jobs) {
+      std::vector<Chunk> chunks;
+      for (auto &range : ranges) {
+        chunks.push_back({range.begin, range.end, range.index, false});
+        size_t length = range.end - range.begin;
+        if (jobs <= 1 || length < 2 * CHUNK_BYTES) continue;
+
+        size_t count = std::min<size_t>(jobs, length / CHUNK_BYTES);
+        for (size_t i = 1; i < count; i++) {
+          size_t start = SnapshotReader::findSnapshotStart(*file, std::max(chunks.back().begin, range.begin + length / count * i));
+          if (start >= range.end) break;
+          if (start > chunks.back().begin) {
+            chunks.back().end = start;
+            chunks.push_back({start, range.end, 0, true});
+          }
+        }
+      }
+      return chunks;
+    };
+
+    std::vector<Chunk> chunks = split(jobs);
+    std::vector<SnapshotReader> readers;
+    std::vector<std::vector<Snapshot>> results;
+    auto parseChunks = [&]() {
+      readers = std::vector<SnapshotReader>(chunks.size());
+      results.assign(chunks.size(), std::vector<Snapshot>());
+      auto parseChunk = [&](size_t i) {
+        readers[i].openRange(*file, chunks[i].begin, chunks[i].end, keep_header, hash_body);
+        readers[i].setFilter(filter);
+        Snapshot snapshot;
+        while (readers[i].next(snapshot)) {
+          results[i].push_back(snapshot);
+        }
+      };
+
+      std::vector<std::thread> threads;
+      for (size_t i = 1; i < chunks.size(); i++) {
+        threads.emplace_back(parseChunk, i);
+      }
+      if (!chunks.empty()) parseChunk(0);
+      for (auto &thread : threads) {
+        thread.join();
+      }
+    };
+    parseChunks();
+
+    // A chunk read alone matches the serial read only if the one before it stopped
+    // where a snapshot mark is expected, otherwise read the ranges again unsplit
+    for (size_t i = 0; i + 1 < chunks.size(); i++) {
+      if (chunks[i + 1].follows && !readers[i].resumable()) {
+        chunks = split(1);
+        parseChunks();
+        break;
+      }
+    }
+
+    size_t index = 0;
+    int ret = 0;
+    for (size_t i = 0; i < chunks.size() && ret == 0; i++) {
+      if (!chunks[i].follows) index = chunks[i].index;
+      uint8_t titled = index == readers[i].titleBase() ? SNAPSHOT_TITLED : 0; // numbered as in the file
+      for (auto &snapshot : results[i]) {
+        snapshot.index += index;
+        snapshot.flags &= titled | SNAPSHOT_NEWLINE;
+        parsed.snapshots.push_back(snapshot);
+      }
+      index += readers[i].started();
+      parsed.headers.insert(parsed.headers.end(), std::make_move_iterator(readers[i].headers.begin()),
+                            std::make_move_iterator(readers[i].headers.end()));
+      parsed.stats.merge(readers[i].stats);
+      ret = readers[i].result();
+    }
+
+    parsed.stats.files = 1;
+    parsed.stats.chunks = chunks.size();
+    parsed.stats.bytes = size;
+    if (ranges.size() == 1 && ranges[0].end < size) {
+      parsed.stats.skipped++; // only the header lines were read
+    }
+    // Keep the mapping alive until the snapshots are written
+    parsed.source = std::move(file);
+    return ret;
+  }
+};
+
+MassifFile::MassifFile() : impl(new Impl()) {
+}
+
+MassifFile::MassifFile(std::initializer_list<std::string_view> paths) : impl(new Impl()) {
+  for (auto path : paths) {
+    impl->add(std::string(path));
+  }
+}
+
+MassifFile::MassifFile(MassifFile &&other) noexcept = default;
+MassifFile &MassifFile::operator=(MassifFile &&other) noexcept = default;
+MassifFile::~MassifFile() = default;
+
+void MassifFile::setIndexOutput(bool enabled) { impl->indexOutput = enabled; }
+void MassifFile::setRetention(const Retention &retention) { impl->retention = retention; }
+void MassifFile::setDedup(bool enabled) { impl->dedup = enabled; }
+void MassifFile::setFilter(const SnapshotFilter &filter) { impl->filter = filter; }
+void MassifFile::setPassthrough(bool enabled) { impl->passthrough = enabled; }
+void MassifFile::setIoUring(bool enabled) {
+  impl->ioUring = enabled && InputRing::available();
+  if (enabled && !impl->ioUring) {
+    std::cerr << "WARN: io_uring is not available, reading the inputs without it" << std::endl;
+  }
+}
+
+int MassifFile::add(std::string_view path) { return impl->add(std::string(path)); }
+int MassifFile::add(const StringList &paths, unsigned jobs) { return impl->add(paths, jobs); }
+size_t MassifFile::skipSameFiles(StringList &paths) { return impl->skipSameFiles(paths); }
+int MassifFile::saveCache(std::string_view path) { return impl->saveCache(std::string(path)); }
+int MassifFile::loadCache(std::string_view path) { return impl->loadCache(std::string(path)); }
+int MassifFile::write(std::string_view path) { return impl->write(std::string(path)); }
+int MassifFile::append(std::string_view path) { return impl->append(std::string(path)); }
+
+int MassifFile::writeTree(std::string_view path, std::string_view mode) {
+  return impl->writeTree(std::string(path), std::string(mode));
+}
+
+int MassifFile::stream(const StringList &paths, std::string_view path, unsigned jobs) {
+  return impl->stream(paths, std::string(path), jobs);
+}
+
+int MassifFile::writeGroups(const StringList &paths, std::string_view path, unsigned jobs, StringList *outputs) {
+  return impl->writeGroups(paths, std::string(path), jobs, outputs);
+}
+
+int MassifFile::visit(const StringList &paths, SnapshotVisitor &visitor) { return impl->visit(paths, visitor); }
+
+const StringList &MassifFile::headers() const { return impl->headers; }
+const std::vector<Snapshot> &MassifFile::snapshots() const { return impl->snapshots; }
+
+std::string_view MassifFile::body(const Snapshot &snapshot) const {
+  return std::string_view(impl->body(snapshot), snapshot.length);
+}
+
+Stats &MassifFile::stats() { return impl->stats; }
+const Stats &MassifFile::stats() const { return impl->stats; }
+
+Summary::Summary(size_t topSites) : topSites(topSites) {
+  peak = Snapshot();
+  detailed = Snapshot();
+}
+
+void Summary::header(size_t, std::string_view line) {
+  static const char prefix[] = "time_unit: ";
+  if (timeUnit.empty() && line.compare(0, sizeof(prefix) - 1, prefix) == 0) {
+    timeUnit = std::string(line.substr(sizeof(prefix) - 1));
+  }
+}
+
+// Index past the subtree of the node at i, nodes are in file order
+static size_t skipSubtree(const std::vector<TreeNode> &tree, size_t i) {
+  size_t next = i + 1;
+  for (uint32_t c = 0; c < tree[i].children && next < tree.size(); c++) {
+    next = skipSubtree(tree, next);
+  }
+  return next;
+}
+
+bool Summary::snapshot(size_t, const Snapshot &snapshot, std::string_view body) {
+  auto total = [](const Snapshot &s) { return s.memHeap + s.memHeapExtra + s.memStacks; };
+  if (count == 0 || snapshot.time < firstTime) firstTime = snapshot.time;
+  if (count == 0 || snapshot.time > lastTime) lastTime = snapshot.time;
+  if (count == 0 || total(snapshot) > total(peak)) peak = snapshot;
+
+  // Online least squares, updated with the deviations before and after the new means
+  count++;
+  double time = snapshot.time, heap = snapshot.memHeap;
+  double dt = time - meanTime;
+  meanTime += dt / count;
+  meanHeap += (heap - meanHeap) / count;
+  timeHeap += dt * (heap - meanHeap);
+  timeTime += dt * (time - meanTime);
+
+  bool hasTree = snapshot.heapTree == HEAP_TREE_DETAILED || snapshot.heapTree == HEAP_TREE_PEAK;
+  if (!hasTree || (hasDetailed && total(snapshot) <= total(detailed))) return true;
+
+  // A new biggest detailed snapshot, keep the top sites of its tree only
+  StringTable table;
+  std::vector<TreeNode> tree;
+  parseHeapTree(body.data(), body.size(), table, tree);
+  hasDetailed = true;
+  detailed = snapshot;
+  sites.clear();
+
+  // The root of a massif tree holds all the heap, the sites are its children
+  std::vector<size_t> tops;
+  for (size_t i = 0; i < tree.size(); i = skipSubtree(tree, i)) {
+    tops.push_back(i);
+  }
+  if (tops.size() == 1 && tree[0].children > 0) {
+    tops.clear();
+    for (size_t i = 1, c = 0; i < tree.size() && c < tree[0].children; i = skipSubtree(tree, i), c++) {
+      tops.push_back(i);
+    }
+  }
+  std::stable_sort(tops.begin(), tops.end(), [&](size_t a, size_t b) { return tree[a].bytes > tree[b].bytes; });
+  for (size_t i = 0; i < tops.size() && i < topSites; i++) {
+    sites.push_back({tree[tops[i]].bytes, table.get(tree[tops[i]].symbol)});
+  }
+  return true;
+}
+
+double Summary::growth() const {
+  return timeTime > 0 ? timeHeap / timeTime : 0;
+}
+
+void Summary::print(std::ostream &out) const {
+  std::string unit = timeUnit.empty() ? "" : " " + timeUnit;
+  out << "Peak: " << peak.memHeap << " B heap, " << peak.memHeapExtra << " B extra, " << peak.memStacks
+      << " B stacks at time " << peak.time << unit << "; " << count << " snapshots from " << firstTime
+      << " to " << lastTime << unit << ", growth " << growth() << " B per "
+      << (timeUnit.empty() ? "time unit" : timeUnit) << std::endl;
+  if (!hasDetailed) return;
+
+  out << "Top sites of the detailed snapshot at time " << detailed.time << unit << ", "
+      << detailed.memHeap << " B heap:" << std::endl;
+  for (auto &site : sites) {
+    out << "  " << site.bytes << " B (" << (detailed.memHeap > 0 ? 100.0 * site.bytes / detailed.memHeap : 0)
+        << "%) " << site.label << std::endl;
+  }
+}
+
+// Write str as a JSON string literal
+static void printJsonString(std::ostream &out, const std::string &str) {
+  out << '"';
+  for (unsigned char c : str) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out << escaped;
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+void Summary::printJson(std::ostream &out) const {
+  out << "{\"snapshots\": " << count << ", \"time_unit\": ";
+  printJsonString(out, timeUnit);
+  out << ", \"first_time\": " << firstTime << ", \"last_time\": " << lastTime
+      << ", \"peak\": {\"time\": " << peak.time << ", \"mem_heap_B\": " << peak.memHeap
+      << ", \"mem_heap_extra_B\": " << peak.memHeapExtra << ", \"mem_stacks_B\": " << peak.memStacks
+      << "}, \"growth_B_per_time_unit\": " << growth() << ", \"detailed\": ";
+  if (!hasDetailed) {
+    out << "null}" << std::endl;
+    return;
+  }
+  out << "{\"time\": " << detailed.time << ", \"mem_heap_B\": " << detailed.memHeap << ", \"sites\": [";
+  for (size_t i = 0; i < sites.size(); i++) {
+    out << (i > 0 ? ", " : "") << "{\"bytes\": " << sites[i].bytes << ", \"label\": ";
+    printJsonString(out, sites[i].label);
+    out << "}";
+  }
+  out << "]}}" << std::endl;
+}
+
+int queryIndex(std::string_view pathView, std::string_view queryView) {
+  std::string path(pathView), query(queryView);
+  SnapshotIndex index;
+  MappedFile file;
+  if (index.open(SnapshotIndex::pathOf(path)) != 0 || file.open(path) != 0) {
+    std::cerr << "WARN: cannot open " << path << " with its index" << std::endl;
+    return 1;
+  }
+
+  std::pair<size_t, size_t> range;
+  size_t colon = query.find(':');
+  if (query == "peak") {
+    size_t peak = index.peak();
+    range = std::make_pair(peak, std::min(peak + 1, index.size()));
+  } else if (colon != std::string::npos) {
+    std::string from = query.substr(0, colon), to = query.substr(colon + 1);
+    range = index.range(from.empty() ? 0 : strtoull(from.c_str(), NULL, 10),
+                        to.empty() ? UINT64_MAX : strtoull(to.c_str(), NULL, 10));
+  } else {
+    std::cerr << "WARN: unknown query " << query << std::endl;
+    return 1;
+  }
+
+  for (size_t i = range.first; i < range.second; i++) {
+    const IndexRecord &record = index.records()[i];
+    if (record.offset + record.length > file.size()) {
+      std::cerr << "WARN: index does not match " << path << std::endl;
+      return 2;
+    }
+    std::cout.write(file.data() + record.offset, record.length);
+  }
+  return 0;
+}
+
+
+bool fileExists(std::string_view file) {
+  struct stat buf;
+  return (stat(std::string(file).c_str(), &buf) == 0);
+}
+
+bool deleteFiles(const StringList &files, bool verbose) {
+  static const size_t DELETE_BATCH = 256;  // files of one directory unlinked through one handle
+  static const unsigned DELETE_JOBS = 8;   // unlinks in flight, mostly waiting on the file system
+
+  // Group the files by directory, each batch is unlinked relative to its directory
+  auto dirOf = [&](size_t i) {
+    size_t slash = files[i].rfind('/');
+    return std::string_view(files[i]).substr(0, slash == std::string::npos ? 0 : slash + 1);
+  };
+  std::vector<size_t> order(files.size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return dirOf(a) < dirOf(b); });
+  std::vector<std::pair<size_t, size_t>> batches; // range of order
+  for (size_t i = 0; i < order.size(); i++) {
+    size_t begin = batches.empty() ? 0 : batches.back().first;
+    if (!batches.empty() && i - begin < DELETE_BATCH && dirOf(order[i]) == dirOf(order[begin])) {
+      batches.back().second = i + 1;
+    } else {
+      batches.push_back({i, i + 1});
+    }
+  }
+
+  if (verbose) {
+    for (auto &file : files) {
+      std::cout << "Deleting file " << file << std::endl;
+    }
+  }
+  std::vector<int> errors(files.size(), 0);
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t b; (b = next++) < batches.size();) {
+      std::string dir(dirOf(order[batches[b].first]));
+      size_t length = dir.size();
+      if (dir.empty()) dir = ".";
+      int dirfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+      for (size_t i = batches[b].first; i < batches[b].second; i++) {
+        const std::string &file = files[order[i]];
+        int ret = dirfd >= 0 ? unlinkat(dirfd, file.c_str() + length, 0) : unlink(file.c_str());
+        if (ret < 0) errors[order[i]] = errno;
+      }
+      if (dirfd >= 0) close(dirfd);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < std::min<size_t>(DELETE_JOBS, batches.size()); i++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto &thread : workers) {
+    thread.join();
+  }
+
+  bool ret = true;
+  for (size_t i = 0; i < files.size(); i++) {
+    if (errors[i] != 0) {
+      std::cerr << "[" << errors[i] << "]" << "Error removing file " << files[i] << std::endl;
+      ret = false;
+    }
+  }
+  return ret;
+}
+
+// Expand a pattern with wildcards in directory names through glob(3)
+static int globFile(StringList &files, const std::string &pattern) {
+  glob_t result;
+  int ret = glob(pattern.c_str(), GLOB_MARK, NULL, &result);
+  if (ret == GLOB_NOMATCH) return 0;
+  if (ret != 0) return 1; // glob fail
+
+  for (size_t i = 0; i < result.gl_pathc; i++) {
+    const char *path = result.gl_pathv[i];
+    size_t len = strlen(path);
+    if (len > 0 && path[len - 1] != '/') { // GLOB_MARK flags directories
+      files.push_back(path);
+    }
+  }
+  globfree(&result);
+  return 0;
+}
+
+int listFile(StringList &files, std::string_view patternView) {
+  std::string pattern(patternView);
+  size_t slash = pattern.rfind('/');
+  std::string prefix = slash == std::string::npos ? "" : pattern.substr(0, slash + 1);
+  std::string name = pattern.substr(prefix.size());
+  if (prefix.find_first_of("*?[") != std::string::npos) {
+    return globFile(files, pattern);
+  }
+
+  // Only the file name has wildcards, match it against one directory scan
+  DIR *dir = opendir(prefix.empty() ? "." : prefix.c_str());
+  if (!dir) return 1; // open directory fail
+
+  std::vector<std::string> found;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (fnmatch(name.c_str(), entry->d_name, FNM_PERIOD) != 0) continue;
+
+    // d_type saves a stat per entry, only links and unknown types need one
+    bool regular = entry->d_type == DT_REG;
+    if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
+      struct stat buf;
+      regular = fstatat(dirfd(dir), entry->d_name, &buf, 0) == 0 && S_ISREG(buf.st_mode);
+    }
+    if (regular) {
+      found.push_back(prefix + entry->d_name);
+    }
+  }
+  closedir(dir);
+
+  std::sort(found.begin(), found.end());
+  files.insert(files.end(), found.begin(), found.end());
+  return 0;
+}
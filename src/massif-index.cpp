@@ -0,0 +1,101 @@
+// libmassif-combine: the sidecar index of combined files, see massif-internal.h
+#include "massif-internal.h"
+
+int SnapshotIndex::write(const std::string &path, const std::vector<IndexRecord> &records) {
+  OutputFile file(path);
+  if (!file) return 1; // Error open file
+
+  IndexHeader header = newHeader(records.size());
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  file.write(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(IndexRecord));
+  file.close(true);
+  return file ? 0 : 2; // Error write file
+}
+
+int SnapshotIndex::append(const std::string &path, size_t count, const std::vector<IndexRecord> &records) {
+  int fd = ::open(path.c_str(), O_RDWR);
+  if (fd < 0) return 1; // Error open file
+
+  IndexHeader header;
+  bool good = pread(fd, &header, sizeof(header), 0) == sizeof(header) && isValid(header) && header.count == count;
+  if (good) {
+    size_t length = records.size() * sizeof(IndexRecord);
+    header.count += records.size();
+    good = pwrite(fd, records.data(), length, sizeof(header) + count * sizeof(IndexRecord)) == (ssize_t)length
+        && pwrite(fd, &header, sizeof(header), 0) == sizeof(header) && fsync(fd) == 0;
+  }
+  close(fd);
+  return good ? 0 : 2; // Error write file
+}
+
+int SnapshotIndex::open(const std::string &path) {
+  if (file.open(path) != 0) return 1; // Error open file
+  if (file.size() < sizeof(IndexHeader)) return 2; // Not an index
+
+  const IndexHeader *header = reinterpret_cast<const IndexHeader *>(file.data());
+  if (!isValid(*header) || file.size() < sizeof(IndexHeader) + header->count * sizeof(IndexRecord)) {
+    return 2; // Not an index, or truncated
+  }
+  return 0;
+}
+
+bool SnapshotIndex::matches(size_t fileSize) const {
+  if (size() == 0) return false;
+  const IndexRecord &last = records()[size() - 1];
+  return last.offset + last.length == fileSize && records()[0].offset <= last.offset;
+}
+
+std::pair<size_t, size_t> SnapshotIndex::range(uint64_t from, uint64_t to) const {
+  const IndexRecord *first = records(), *last = records() + size();
+  const IndexRecord *begin = std::lower_bound(first, last, from,
+        [](const IndexRecord &r, uint64_t time) { return r.time < time; });
+  const IndexRecord *end = std::upper_bound(begin, last, to,
+        [](uint64_t time, const IndexRecord &r) { return time < r.time; });
+  return std::make_pair(begin - first, end - first);
+}
+
+size_t SnapshotIndex::peak() const {
+  size_t best = size();
+  uint64_t bestTotal = 0;
+  for (size_t i = 0; i < size(); i++) {
+    const IndexRecord &r = records()[i];
+    uint64_t total = r.memHeap + r.memHeapExtra + r.memStacks;
+    if (best == size() || total > bestTotal) {
+      best = i;
+      bestTotal = total;
+    }
+  }
+  return best;
+}
+
+IndexHeader SnapshotIndex::newHeader(size_t count) {
+  IndexHeader header;
+  memcpy(header.magic, "MSFINDEX", sizeof(header.magic));
+  header.version = VERSION;
+  header.recordSize = sizeof(IndexRecord);
+  header.count = count;
+  return header;
+}
+
+bool SnapshotIndex::isValid(const IndexHeader &header) {
+  return memcmp(header.magic, "MSFINDEX", sizeof(header.magic)) == 0
+      && header.version == VERSION && header.recordSize == sizeof(IndexRecord);
+}
+
+int replaceFile(const std::string &temp, const std::string &path, bool indexed) {
+  struct stat buf;
+  if (stat(path.c_str(), &buf) == 0) chmod(temp.c_str(), buf.st_mode & 07777); // keep its permissions
+  if (rename(temp.c_str(), path.c_str()) < 0) return 3; // Error replace file
+  if (indexed && rename(SnapshotIndex::pathOf(temp).c_str(), SnapshotIndex::pathOf(path).c_str()) < 0) {
+    return 4; // Error write index
+  }
+  size_t slash = path.rfind('/');
+  std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (fd >= 0) {
+    fsync(fd);
+    ::close(fd);
+  }
+  return 0;
+}
+
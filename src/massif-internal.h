@@ -0,0 +1,964 @@
+// Internals of libmassif-combine shared by its translation units, the command line tool,
+// bench/massif-bench and bench/massif-fuzz: mapped inputs, buffered outputs, the snapshot
+// parser, index and heap tree types. Defined in massif-io.cpp, massif-reader.cpp,
+// massif-index.cpp and massif-tree.cpp
+#ifndef MASSIF_INTERNAL_H
+#define MASSIF_INTERNAL_H
+
+#include "massif-combine.h"
+
+#include <iostream>
+#include <vector>
+#include <memory>
+#include <string>
+#include <algorithm>
+#include <iterator>
+#include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <cerrno>
+#include <cstdint>
+#include <tuple>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <queue>
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+typedef std::vector<std::string> StringList;
+
+typedef std::chrono::steady_clock Clock;
+
+// Seconds elapsed since start
+inline double secondsSince(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Fast non-cryptographic hash of a block, four independent lanes of 8 bytes per step
+uint64_t hashBytes(const char *data, size_t length);
+
+// Body of a snapshot without its last newline, the last snapshot of a file may have none
+inline size_t bodyLength(const char *body, size_t length) {
+  return length > 0 && body[length - 1] == '\n' ? length - 1 : length;
+}
+
+// Compression of a file, inputs are detected by their magic bytes, outputs by their extension
+typedef enum {
+  CODEC_NONE,
+  CODEC_GZIP,   // .gz, needs HAVE_ZLIB
+  CODEC_ZSTD,   // .zst, needs HAVE_ZSTD
+} Codec;
+
+Codec codecOfPath(const std::string &path);
+
+// Path with suffix inserted before the compression extension, if any
+std::string suffixPathOf(const std::string &path, const std::string &suffix);
+
+// Path next to path for writing it aside, keeping the compression extension
+std::string tempPathOf(const std::string &path);
+
+// Whether path is written aside and renamed over: regular files and new paths, not
+// pipes, devices or symbolic links
+bool isReplaceable(const std::string &path);
+
+// Read-only memory mapping of a whole input file, compressed files are
+// decompressed into an anonymous mapping instead, whole or as they are read
+class MappedFile {
+public:
+  MappedFile() : data_(nullptr), size_(0), mapped_(0), status_(0) {
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile();
+
+  /**
+   * @brief Map a file into memory
+   * 
+   * @param path path to file
+   * @param streamed decompress a compressed file a block at a time by more(), the pages
+   * read are dropped by discard: its memory is what is not consumed yet, not the whole file
+   * @return int 0 if success, or fails
+   */
+  int open(const std::string &path, bool streamed = false);
+
+  /**
+   * @brief Take the content of a file already read into an anonymous mapping, which is
+   * unmapped with this file. It is decompressed like open does
+   * 
+   * @param path path to file
+   * @param data content, nullptr when empty
+   * @param size size of the content
+   * @param mapped length of the mapping
+   * @return int 0 if success, or fails
+   */
+  int adopt(const std::string &path, char *data, size_t size, size_t mapped);
+
+  /**
+   * @brief Decompress the next block of a file opened streamed, the content already
+   * decompressed stays in place
+   * 
+   * @return bool true if the content grew, false once it is complete or on error
+   */
+  bool more();
+
+  /**
+   * @brief Drop the pages before offset from memory, they are read back from the file if
+   * touched again, or read as zeros for a decompressed file
+   * 
+   * @param offset end of the consumed range
+   */
+  void discard(size_t offset) const;
+
+  // Read ahead of the pages touched, or only the pages touched while a few are looked up
+  void sequential(bool enabled) const;
+
+  // Drop all the pages of a file mapped as is, they are read back from the page cache
+  // if touched again. An adopted copy is swapped for a mapping of its file first, unless
+  // the file changed size. A decompressed content is kept, it exists nowhere else
+  void drop();
+
+  /**
+   * @brief Start reading a range in the background, before it is parsed
+   * 
+   * @param offset start of the range
+   * @param length size of the range, clipped to the end of the file
+   */
+  void prefetch(size_t offset, size_t length) const;
+
+  /**
+   * @brief Start reading a whole file in the background, before it is opened
+   * 
+   * @param path path to file
+   */
+  static void prefetch(const std::string &path);
+
+  const char *data() const { return data_; }
+  // Bytes of content so far, a streamed file grows while another thread reads it
+  size_t size() const { return size_; }
+  // Whether the whole content is here, false while a streamed file is decompressed
+  bool complete() const { return inflater_ == nullptr; }
+  // Status of the decompression, 0 if success, or it failed and the content is cut there
+  int result() const { return status_; }
+  // Path of a file mapped as is, empty when decompressed or adopted and not dropped yet:
+  // its content lives only here
+  const std::string &path() const { return path_; }
+
+private:
+  // Output reserved for a streamed file, per byte of compressed input: the most gzip
+  // can inflate to. The content cannot move as it grows, it is read meanwhile
+  static const size_t STREAM_RATIO = 1024;
+  static const size_t STREAM_RESERVE = (size_t)1 << 30;  // reserved at least
+  static const size_t STREAM_RESERVE_MAX = (size_t)1 << 40;  // at most, many inputs are streamed at once
+
+  // State of a decompression going on
+  typedef struct {
+    Codec codec;
+    std::string path;
+    const char *input;      // mapping of the compressed file
+    size_t inputSize;
+    size_t inputMapped;
+    size_t consumed;        // compressed bytes decompressed
+    size_t released;        // compressed bytes dropped from memory
+    size_t reserved;        // address range of a streamed output, 0 when the output may move
+    size_t committed;       // writable part of the output
+    bool finished;          // the whole input is decompressed
+#ifdef HAVE_ZLIB
+    z_stream gzip;
+    bool memberEnded;       // inflate reached the end of a gzip member
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zstd;
+#endif
+  } Inflater;
+
+  char *data_;
+  std::atomic<size_t> size_;
+  size_t mapped_;   // length of the mapping, at least size_
+  int status_;
+  std::string path_;
+  std::string copied_;  // file an adopted content was read from as is, until mapped
+  std::unique_ptr<Inflater> inflater_;  // while the content is decompressed
+
+  // Decompress the content if it is compressed, the path is kept when the file is mapped as is
+  int opened(const std::string &path, bool fileBacked, bool streamed);
+
+  // Replace an adopted copy by a mapping of the file it was read from
+  void mapCopied();
+
+  Codec codecOfData() const;
+
+  // Swap the mapping of the compressed file for an empty output it is decompressed into.
+  // A streamed output is an address range reserved once and made writable as it fills,
+  // another one is a mapping that moves when it grows
+  int startInflate(const std::string &path, Codec codec, bool streamed);
+
+  // End the decompression with its status, the compressed file is unmapped
+  void endInflate(int ret);
+
+  // Writable bytes after the content, up to wanted: a streamed output is made writable
+  // in its reservation, another one grows. 0 when no room is left
+  size_t room(Inflater &inflater, size_t wanted);
+
+  // Decompress a block of a gzip input, concatenated members as written by --append,
+  // return 0 while it goes on, or fails
+  int inflateGzip(Inflater &inflater);
+
+  // Decompress a block of a zstd input, concatenated frames are read through,
+  // return 0 while it goes on, or fails
+  int inflateZstd(Inflater &inflater);
+};
+
+// Input file descriptors for OutputFile::copy, the file of the last block stays open
+// so runs of blocks from one input share it
+class CopySource {
+public:
+  CopySource() : fd(-1) {
+  }
+
+  CopySource(const CopySource &) = delete;
+  CopySource &operator=(const CopySource &) = delete;
+
+  ~CopySource() {
+    if (fd >= 0) close(fd);
+  }
+
+  // Descriptor to copy blocks of file from, -1 if it was decompressed or cannot be opened
+  int of(const MappedFile &file);
+
+private:
+  std::string path;
+  int fd;
+};
+
+// Reads small input files whole ahead of the parser, keeping up to DEPTH of them opened
+// and read at once through io_uring, for file systems where each open or read waits on
+// the network. take hands each file over as an adopted MappedFile; it returns nullptr
+// for files the ring did not read (too large, failed, or no io_uring in the build or
+// the kernel), which the caller maps itself. Not thread safe
+class InputRing {
+public:
+  explicit InputRing(const std::vector<std::string> &paths);
+
+  InputRing(const InputRing &) = delete;
+  InputRing &operator=(const InputRing &) = delete;
+
+  ~InputRing();
+
+  // Whether io_uring reads the inputs, else take always returns nullptr
+  explicit operator bool() const { return ringFd >= 0; }
+
+  // Whether this build and the kernel run io_uring
+  static bool available();
+
+  /**
+   * @brief Wait until an input is read, and start reading the next ones
+   * 
+   * @param i index of the input in paths, each taken once
+   * @return std::unique_ptr<MappedFile> its content, or nullptr to open it without the ring
+   */
+  std::unique_ptr<MappedFile> take(size_t i);
+
+private:
+  static const unsigned DEPTH = 32;             // inputs opened or read ahead at once
+  static const unsigned ENTRIES = 2 * DEPTH;    // an open and a statx per input
+  static const size_t MAX_BYTES = 16 << 20;     // larger inputs are mapped, read ahead by the kernel
+
+  struct Input {
+    enum { IDLE, OPENING, READING, DONE, FAILED, TAKEN } stage = IDLE;
+    int fd = -1;
+    int pending = 0;    // operations in flight
+    bool failed = false;
+#ifdef HAVE_IO_URING
+    struct statx status;
+#endif
+    char *data = nullptr;
+    size_t size = 0;
+    size_t mapped = 0;
+    size_t done = 0;    // bytes read
+  };
+
+  const std::vector<std::string> &paths;
+  std::vector<Input> inputs;
+  int ringFd = -1;
+
+#ifdef HAVE_IO_URING
+  enum { OP_OPEN, OP_STATX, OP_READ };
+
+  size_t cursor = 0;      // next input to start
+  unsigned waiting = 0;   // inputs started and not taken, holding memory
+  unsigned running = 0;   // operations the kernel has not completed
+  unsigned queued = 0;    // operations not submitted yet
+  bool disabled = false;  // the kernel lacks an operation, the rest is opened without the ring
+  bool closing = false;   // only wait for the operations in flight
+  void *sqRing = MAP_FAILED, *cqRing = MAP_FAILED;
+  size_t sqLength = 0, cqLength = 0, sqeLength = 0;
+  unsigned *sqTail, sqMask, *sqArray, *cqHead, *cqTail, cqMask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+
+  void unmapRings();
+
+  // Start the inputs after the taken ones while fewer than DEPTH hold memory
+  void fill();
+
+  // Open an input and read its size at once
+  void start(size_t i);
+
+  // Read the rest of an input
+  void read(size_t i);
+
+  // Next submission entry, cleared and tagged with the input and the operation
+  struct io_uring_sqe *push(size_t i, unsigned op);
+
+  // Hand the queued entries to the kernel
+  void submit();
+
+  // Handle the completed operations, waiting for one when wait is set
+  bool reap(bool wait);
+
+  // Move an input to its next stage with the result of one of its operations
+  void complete(size_t i, unsigned op, int res);
+#endif
+};
+
+// Output file with a large write buffer, big blocks bypass the buffer with writev
+class OutputFile {
+public:
+  OutputFile(const std::string &path, bool append = false);
+
+  OutputFile(const OutputFile &) = delete;
+  OutputFile &operator=(const OutputFile &) = delete;
+
+  ~OutputFile() {
+    close();
+  }
+
+  /**
+   * @brief Append a block to the file
+   * 
+   * @param data block to write
+   * @param length size of the block
+   * @return OutputFile& this file, check with operator! for errors
+   */
+  OutputFile &write(const char *data, size_t length);
+
+  OutputFile &write(const std::string &str) {
+    return write(str.data(), str.size());
+  }
+
+  /**
+   * @brief Append a block of an input file, copied by the kernel from file to file when
+   * both support it, written from its mapping otherwise
+   * 
+   * @param in input file descriptor, -1 to write from data
+   * @param offset position of the block in the input file
+   * @param data block in the mapping of the input file
+   * @param length size of the block
+   * @return OutputFile& this file, check with operator! for errors
+   */
+  OutputFile &copy(int in, uint64_t offset, const char *data, size_t length);
+
+  OutputFile &put(char c) {
+    if (!good) return *this;
+    if (used == BUFFER_SIZE) flush();
+    buffer[used++] = c;
+    return *this;
+  }
+
+  // Write the buffered data to the file
+  void flush();
+
+  // Write the buffered data and close the file, with sync its content reaches the disk
+  // first (pipes and devices cannot sync and do not fail)
+  void close(bool sync = false);
+
+  // Offset of the next byte written in the uncompressed content
+  uint64_t offset() const { return written + used; }
+
+  // Start offset() at the uncompressed size of the content already in an appended file
+  void startAt(uint64_t offset) { written = offset; }
+
+  explicit operator bool() const { return good; }
+  bool operator!() const { return !good; }
+
+private:
+  static const size_t BUFFER_SIZE = 1 << 20;
+  static const size_t DIRECT_SIZE = 64 << 10; // blocks from this size are not copied
+  static const uint64_t WRITEBACK_SIZE = 32 << 20;
+
+  int fd;
+  size_t used;
+  uint64_t written;   // uncompressed bytes given to the file
+  bool good;
+  bool copying = true; // copy_file_range works to this file
+  uint64_t fileBytes = 0;   // bytes written to the file, compressed
+  uint64_t writtenBack = 0; // of which writeback was started
+  std::unique_ptr<char[]> buffer;
+  Codec codec;
+  std::unique_ptr<char[]> packed; // compressed output, before it goes to the file
+#ifdef HAVE_ZLIB
+  z_stream gzip;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_CStream *zstd = nullptr;
+#endif
+
+  // Prepare the compressor for the codec of the output, appended files get a new
+  // gzip member or zstd frame, which readers decompress as one content
+  bool startCodec();
+
+  // Flush the compressor and write the end of the gzip member or zstd frame
+  void endCodec();
+
+  // Compress a block and write what the compressor gives back
+  void compress(const char *data, size_t length, bool finish);
+
+  void writeRaw(const char *data, size_t length);
+
+  // Write the vectors, through the compressor if any
+  void writeAll(struct iovec *iov, int count);
+
+  // Count bytes that reached the file, and start writing the last WRITEBACK_SIZE of them
+  // to the disk so the sync in close has little left to wait for
+  void wroteOut(size_t length);
+
+  // writev until every vector is written
+  void writeVector(struct iovec *iov, int count);
+};
+
+// Blocking FIFO between two pipeline stages, push waits while capacity items are queued
+template <typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {
+  }
+
+  // Queue an item, dropped if the queue was closed
+  void push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [&]() { return items.size() < capacity || closed; });
+    if (closed) return;
+    items.push(std::move(item));
+    notEmpty.notify_one();
+  }
+
+  // Take the oldest item, false once the queue is closed and empty
+  bool pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [&]() { return !items.empty() || closed; });
+    if (items.empty()) return false;
+    item = std::move(items.front());
+    items.pop();
+    notFull.notify_one();
+    return true;
+  }
+
+  // Wake up every waiting stage, no more items are pushed
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notFull.notify_all();
+    notEmpty.notify_all();
+  }
+
+private:
+  size_t capacity;
+  bool closed;
+  std::queue<T> items;
+  std::mutex mutex;
+  std::condition_variable notFull, notEmpty;
+};
+
+// Heap tree scanner: from the start of a tree line at offset, find the first line
+// starting with '#', 'c', 'd', 'h', 'm' or 't' (a mark, a header or a snapshot field),
+// return its offset or size, and add the lines skipped before it to lines
+typedef size_t (*TreeScan)(const char *data, size_t offset, size_t size, uint64_t &lines);
+
+inline bool isTreeEnd(char c) {
+  switch (c) {
+  case '#': case 'c': case 'd': case 'h': case 'm': case 't':
+    return true;
+  default:
+    return false;
+  }
+}
+
+// One line at a time, the scan of the vector versions past their last full block
+size_t scanTreeScalar(const char *data, size_t offset, size_t size, uint64_t &lines);
+
+#if defined(__x86_64__)
+// Newlines found 64 bytes at a time, see massif-reader.cpp
+size_t scanTreeSse2(const char *data, size_t offset, size_t size, uint64_t &lines);
+
+__attribute__((target("avx2,popcnt")))
+size_t scanTreeAvx2(const char *data, size_t offset, size_t size, uint64_t &lines);
+#endif
+
+// Widest tree scanner the CPU runs, MASSIF_SCAN=scalar|sse2|avx2 picks one for testing
+TreeScan selectTreeScan(const char **name = nullptr);
+
+// Scanner of SnapshotReader, picked once at startup
+extern const TreeScan scanTree;
+
+// Incremental parser of a massif file, returns one snapshot at a time
+class SnapshotReader {
+public:
+  StringList headers;
+  Stats stats;
+
+public:
+  SnapshotReader() : mapped(nullptr), status(LastLine::NONE), cursor(0), limit(0), count(0), base(0),
+                     error(0), reading(false) {
+  }
+
+  /**
+   * @brief Map a massif file and prepare to read its snapshots, a compressed file is
+   * decompressed as it is read
+   * 
+   * @param path path to massif file
+   * @param keep_header collect header lines into headers
+   * @param hash_body fill Snapshot::hash for --dedup
+   * @return int 0 if success, or fails
+   */
+  int open(const std::string &path, bool keep_header = true, bool hash_body = false);
+
+  /**
+   * @brief Prepare to read the snapshots of a range of a file mapped by the caller.
+   * A range from the middle of the file starts on a snapshot mark and is read as if
+   * the previous snapshot ended there
+   * 
+   * @param source mapped massif file, outlives the reader
+   * @param begin start of the range, 0 or a start found by findSnapshotStart
+   * @param end end of the range, at a line start
+   * @param keep_header collect header lines into headers
+   * @param hash_body fill Snapshot::hash for --dedup
+   */
+  void openRange(const MappedFile &source, size_t begin, size_t end, bool keep_header = true, bool hash_body = false);
+
+  /**
+   * @brief Read the next snapshot of the file
+   * 
+   * @param snapshot filled with the next snapshot
+   * @return bool true if a snapshot was read, false at end of file or on error
+   */
+  bool next(Snapshot &snapshot);
+
+  /**
+   * @brief Status of the reading
+   * 
+   * @return int 0 if success, or fails
+   */
+  int result() const { return error; }
+
+  // Keep only the snapshots accepted by filter, the others count as filtered
+  void setFilter(const SnapshotFilter &filter) { this->filter = filter; }
+
+  // Snapshots started so far, numbering the next one
+  size_t started() const { return count; }
+
+  // Number of the first snapshot of the range the SNAPSHOT_TITLED flags were checked
+  // against: 0 from the start of the file, else read from its first name line
+  size_t titleBase() const { return base; }
+
+  /**
+   * @brief Length of the title lines of a snapshot, as written in a combined file
+   * 
+   * @param title filled with the "#-----------", "snapshot=N", "#-----------" lines
+   * @param index snapshot number N
+   * @return int length of the lines
+   */
+  static int formatTitle(char (&title)[64], size_t index) {
+    return snprintf(title, sizeof(title), "#-----------\nsnapshot=%zu\n#-----------\n", index);
+  }
+
+  // Whether a range starting where this one stopped reads as it would after it:
+  // the state machine accepts a snapshot mark there
+  bool resumable() const {
+    return error == 0 && (status == LastLine::HEADER || status == LastLine::SNAPSHOT_CONTENT);
+  }
+
+  // Mapped file, snapshot lines point into it
+  const MappedFile &source() const { return *mapped; }
+
+  // Give up ownership of the mapped file
+  std::unique_ptr<MappedFile> release() { return std::move(file); }
+
+  /**
+   * @brief Find the last snapshot of a massif file by reading it backwards
+   * 
+   * @param file mapped massif file
+   * @param time filled with the time of the last snapshot
+   * @return size_t number of the last snapshot plus one, 0 if there is no snapshot
+   */
+  static size_t findLastSnapshot(const MappedFile &file, uint64_t &time);
+
+  /**
+   * @brief Check on the times of the first and last snapshots whether no snapshot of a
+   * file can pass the time window of filter, massif writes the snapshots in time order
+   * 
+   * @param file mapped massif file
+   * @param filter snapshot filter
+   * @return bool true if the file can be skipped
+   */
+  static bool missesWindow(const MappedFile &file, const SnapshotFilter &filter);
+
+  /**
+   * @brief Find the first snapshot start at or after an offset, the "#-----------",
+   * "snapshot=N", "#-----------" lines
+   * 
+   * @param file mapped massif file
+   * @param from offset to search from
+   * @return size_t offset of the first mark line, or the size of the file
+   */
+  static size_t findSnapshotStart(const MappedFile &file, size_t from);
+
+private:
+  typedef enum {
+    HEADER,
+    SNAPSHOT_MARK,
+    SNAPSHOT_NAME,
+    SNAPSHOT_CONTENT,
+    NONE,
+  } LastLine;
+
+  std::unique_ptr<MappedFile> file;   // mapping opened by open(), if any
+  const MappedFile *mapped;           // mapping read
+  SnapshotFilter filter;
+  bool keep_header;
+  bool hash_body;
+  LastLine status;
+  size_t cursor;                      // offset of the next line to read
+  size_t limit;                       // end of the range read
+  size_t count;                       // snapshots started so far
+  size_t base;                        // titleBase()
+  int error;
+  bool reading;                       // current holds a snapshot being read
+  Snapshot current;
+
+  // End the current snapshot, it is returned if it has content
+  bool finish(Snapshot &snapshot);
+
+  // Whether the lines before a body starting at offset are the title of number index
+  bool isTitled(size_t offset, size_t index) const;
+
+  // Read the snapshot fields used for ordering and indexing, true on the heap_tree= line
+  bool parseField(const char *str, size_t len);
+
+  /**
+   * Skip the heap tree lines from offset without classifying them. Tree lines start
+   * with ' ' or 'n', so the tree ends before the first line starting like a mark,
+   * a header or a snapshot field, which then goes through the state machine.
+   * The scan runs over newlines a vector at a time, see scanTree.
+   */
+  size_t skipTree(size_t offset);
+
+  // Decompress more of a file opened by open(), false once all of it is here. A failed
+  // decompression ends the reading with an error
+  bool grow();
+
+  // Check whether line begins with the string literal prefix
+  template <size_t N>
+  static bool startsWith(const char *line, size_t len, const char (&prefix)[N]) {
+    return len >= N - 1 && memcmp(line, prefix, N - 1) == 0;
+  }
+
+  // Check whether line begins with prefix followed by at least one digit
+  template <size_t N>
+  static bool startsWithNumber(const char *line, size_t len, const char (&prefix)[N]) {
+    return len > N - 1 && startsWith(line, len, prefix) && isdigit((unsigned char)line[N - 1]);
+  }
+
+  // Parse the leading digits of str, saturates instead of overflowing
+  static uint64_t parseNumber(const char *str, size_t len);
+
+  // Header line: "desc:", "cmd:" or "time_unit:"
+  static bool isKeywordLine(const char *line, size_t len);
+
+  // Snapshot separator line "#-----------"
+  static bool isSnapshotMark(const char *line, size_t len);
+};
+
+// Parser stage of the streaming merge: worker threads open the inputs and parse them
+// ahead of the merge, each input into its own lane, within a budget of parsed bytes
+// not yet merged. A lane holds one batch for the merge and asks for the next one
+// when the merge takes it
+class ReadAhead {
+public:
+  ReadAhead(const std::vector<std::string> &paths, unsigned jobs, const SnapshotFilter &filter = SnapshotFilter());
+
+  ReadAhead(const ReadAhead &) = delete;
+  ReadAhead &operator=(const ReadAhead &) = delete;
+
+  ~ReadAhead();
+
+  /**
+   * @brief Take the next snapshot of an input, waits until a worker parsed it
+   * 
+   * @param input input index
+   * @param snapshot filled with the next snapshot
+   * @return bool true if a snapshot was read, false at end of input or if it cannot be opened
+   */
+  bool next(size_t input, Snapshot &snapshot);
+
+  // Reader of an input once next() returned for it, nullptr if it cannot be opened
+  SnapshotReader *reader(size_t input) { return lanes[input].reader.get(); }
+
+  // Unmap a finished input
+  void release(size_t input) { lanes[input].reader = nullptr; }
+
+  // Seconds spent parsing, summed over the workers
+  double parseTime() const { return parseNanos / 1e9; }
+
+private:
+  static const size_t BATCH_SIZE = 256;        // snapshots parsed per request at most
+  static const size_t LANE_BYTES = 1 << 20;    // body bytes parsed per request at most
+  static const size_t BUDGET_BYTES = 16 << 20; // body bytes parsed ahead of the merge
+
+  typedef struct Lane {
+    std::unique_ptr<SnapshotReader> reader;
+    std::vector<Snapshot> ready;   // filled by a worker, guarded by mutex
+    std::vector<Snapshot> taken;   // owned by the merge
+    size_t next = 0;               // next snapshot of taken
+    bool filled = false;           // ready holds the answer of the last request
+    bool done = false;             // the worker reached the end of the input
+    bool finished = false;         // the merge saw done
+  } Lane;
+
+  const std::vector<std::string> &paths;
+  SnapshotFilter filter;
+  std::vector<Lane> lanes;
+  std::queue<size_t> wanted;       // lanes waiting for a worker
+  std::atomic<size_t> ahead;
+  std::atomic<uint64_t> parseNanos{0};
+  bool stopping;
+  std::mutex mutex;
+  std::condition_variable workCv, readyCv;
+  std::vector<std::thread> threads;
+
+  // Answer lane requests until stopped
+  void work();
+
+  // Parse the next batch of an input, at least one snapshot so the merge can go on
+  bool fill(size_t input, Lane &lane, std::vector<Snapshot> &batch);
+};
+
+// Entry of the sidecar index of a combined file, stored in native byte order
+typedef struct {
+  uint64_t offset;        // position of the snapshot title in the combined file
+  uint64_t length;        // size of the title and the body
+  uint64_t time;
+  uint64_t memHeap;
+  uint64_t memHeapExtra;
+  uint64_t memStacks;
+  uint8_t heapTree;       // HeapTree
+  uint8_t reserved[7];
+} IndexRecord;
+
+typedef struct {
+  char magic[8];          // "MSFINDEX"
+  uint32_t version;
+  uint32_t recordSize;    // sizeof(IndexRecord)
+  uint64_t count;         // number of records following the header
+} IndexHeader;
+// Sidecar index "<output>.idx": a header then one record per snapshot in output order
+class SnapshotIndex {
+public:
+  static std::string pathOf(const std::string &output) {
+    return output + ".idx";
+  }
+
+  /**
+   * @brief Write a new index file
+   * 
+   * @param path index file path
+   * @param records records of every snapshot of the combined file
+   * @return int 0 if success, or fails
+   */
+  static int write(const std::string &path, const std::vector<IndexRecord> &records);
+
+  /**
+   * @brief Add records to an existing index file
+   * 
+   * @param path index file path
+   * @param count number of records the index must already hold
+   * @param records records of the appended snapshots
+   * @return int 0 if success, or fails
+   */
+  static int append(const std::string &path, size_t count, const std::vector<IndexRecord> &records);
+
+  /**
+   * @brief Map an index file
+   * 
+   * @param path index file path
+   * @return int 0 if success, or fails
+   */
+  int open(const std::string &path);
+
+  size_t size() const {
+    return reinterpret_cast<const IndexHeader *>(file.data())->count;
+  }
+
+  const IndexRecord *records() const {
+    return reinterpret_cast<const IndexRecord *>(file.data() + sizeof(IndexHeader));
+  }
+
+  // Whether the records end with a combined file of this size, so it was not changed since
+  bool matches(size_t fileSize) const;
+
+  /**
+   * @brief Find the snapshots with from <= time <= to, the combined file is sorted by time
+   * 
+   * @return std::pair<size_t, size_t> first and past the last matching record
+   */
+  std::pair<size_t, size_t> range(uint64_t from, uint64_t to) const;
+
+  /**
+   * @brief Find the snapshot using the most memory, heap, heap extra and stacks together
+   * 
+   * @return size_t record of the peak, size() if the index is empty
+   */
+  size_t peak() const;
+
+private:
+  static const uint32_t VERSION = 1;
+
+  MappedFile file;
+
+  static IndexHeader newHeader(size_t count);
+
+  static bool isValid(const IndexHeader &header);
+};
+
+// Replace path by temp, and its index with the one of temp when indexed, then sync the
+// directory so the renames survive a crash. The file goes first, an older index left
+// next to it does not match it and its readers ignore it
+int replaceFile(const std::string &temp, const std::string &path, bool indexed);
+
+// Deduplicated strings, each one stored once and referred to by id
+class StringTable {
+public:
+  uint32_t intern(const char *str, size_t len);
+
+  const std::string &get(uint32_t id) const { return *strings[id]; }
+  size_t size() const { return strings.size(); }
+
+private:
+  std::unordered_map<std::string, uint32_t> ids;
+  std::vector<const std::string *> strings;  // keys of ids, node-based so they do not move
+};
+
+// Heap tree node, a tree is its nodes in file order, each followed by its children
+typedef struct {
+  uint64_t bytes;
+  uint32_t symbol;    // label in a StringTable: "0x...: func (file:line)", "in N places, ..."
+  uint32_t children;
+} TreeNode;
+
+/**
+ * @brief Parse the heap tree lines "<depth spaces>n<children>: <bytes> <label>" of a snapshot body
+ * 
+ * @param body snapshot body
+ * @param length size of the body
+ * @param table interns the labels
+ * @param tree filled with the nodes, empty if the snapshot has no heap tree
+ */
+void parseHeapTree(const char *body, size_t length, StringTable &table, std::vector<TreeNode> &tree);
+
+// Heap trees of many snapshots merged by call path, with signed byte counts
+class MergedTree {
+public:
+  MergedTree() {
+    nodes.push_back(Node{0, 0, 0}); // root above the allocation function nodes
+  }
+
+  /**
+   * @brief Add the bytes of a tree, nodes with the same call path are merged
+   * 
+   * @param tree nodes of a parsed heap tree
+   * @param sign 1 to add the tree, -1 to subtract it
+   */
+  void add(const std::vector<TreeNode> &tree, int64_t sign);
+
+  // Bytes of the top level nodes together, as written
+  int64_t total() const;
+
+  /**
+   * @brief Write the tree in massif format, largest children first. Subtrees without
+   * any byte are left out, so a delta only shows what changed. Massif sizes are never
+   * negative and a node holds at least the sum of its children: a node that shrank, or
+   * grew less than its children, is written with that size, its signed change after the label
+   * 
+   * @param file output file
+   * @param table labels of the nodes
+   */
+  void write(OutputFile &file, const StringTable &table) const;
+
+private:
+  typedef struct {
+    int64_t bytes;
+    uint32_t symbol;
+    uint32_t parent;
+  } Node;
+
+  std::vector<Node> nodes;
+  std::unordered_map<uint64_t, uint32_t> index; // (parent, symbol) -> node
+
+  uint32_t child(uint32_t parent, uint32_t symbol);
+
+  // Children of the written nodes, largest change first, and the sizes written for them
+  void layout(std::vector<std::vector<uint32_t>> &children, std::vector<int64_t> &sizes) const;
+
+  void writeNode(OutputFile &file, const StringTable &table, const std::vector<std::vector<uint32_t>> &children,
+                 const std::vector<int64_t> &sizes, uint32_t id, size_t depth) const;
+};
+
+// Header of a parsed state cache, see MassifFile::saveCache. Stored in native byte
+// order and followed by the snapshot records, the header lines, then the bodies
+typedef struct {
+  char magic[8];          // "MSFCACHE"
+  uint32_t version;
+  uint32_t recordSize;    // sizeof(Snapshot)
+  uint64_t count;         // number of snapshot records
+  uint64_t headerBytes;   // header lines, each one ended by a newline
+  uint64_t bodyBytes;     // snapshot bodies, in record order
+} CacheHeader;
+
+// Result of parsing one input file, merged into MassifFile in argument order
+typedef struct {
+  StringList headers;
+  std::vector<Snapshot> snapshots;
+  std::unique_ptr<MappedFile> source;
+  Stats stats;
+} ParsedFile;
+
+#endif
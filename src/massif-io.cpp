@@ -0,0 +1,771 @@
+// libmassif-combine: mapped inputs and buffered outputs, see massif-internal.h
+#include "massif-internal.h"
+
+uint64_t hashBytes(const char *data, size_t length) {
+  const uint64_t K = 0x9e3779b97f4a7c15ULL;
+  uint64_t lanes[4] = {length * K, ~length * K, length ^ K, ~length ^ K};
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    for (int j = 0; j < 4; j++) {
+      uint64_t word;
+      memcpy(&word, data + i + j * 8, 8);
+      lanes[j] = (lanes[j] ^ word) * K;
+      lanes[j] ^= lanes[j] >> 29;
+    }
+  }
+  uint64_t h = lanes[0] ^ (lanes[1] * 3) ^ (lanes[2] * 5) ^ (lanes[3] * 7);
+  for (; i < length; i += 8) {
+    uint64_t word = 0;
+    memcpy(&word, data + i, std::min<size_t>(8, length - i));
+    h = (h ^ word) * K;
+    h ^= h >> 29;
+  }
+  h ^= h >> 32;
+  h *= K;
+  return h ^ (h >> 29);
+}
+
+Codec codecOfPath(const std::string &path) {
+  auto endsWith = [&](const char *ext) {
+    size_t len = strlen(ext);
+    return path.size() > len && path.compare(path.size() - len, len, ext) == 0;
+  };
+  return endsWith(".gz") ? CODEC_GZIP : endsWith(".zst") ? CODEC_ZSTD : CODEC_NONE;
+}
+
+std::string suffixPathOf(const std::string &path, const std::string &suffix) {
+  Codec codec = codecOfPath(path);
+  size_t ext = codec == CODEC_GZIP ? 3 : codec == CODEC_ZSTD ? 4 : 0;
+  return path.substr(0, path.size() - ext) + suffix + path.substr(path.size() - ext);
+}
+
+std::string tempPathOf(const std::string &path) {
+  return suffixPathOf(path, ".tmp");
+}
+
+bool isReplaceable(const std::string &path) {
+  struct stat buf;
+  return lstat(path.c_str(), &buf) == 0 ? S_ISREG(buf.st_mode) : errno == ENOENT;
+}
+
+MappedFile::~MappedFile() {
+  if (inflater_ != nullptr) {
+    endInflate(0);
+  }
+  if (data_ != nullptr) {
+    munmap(data_, mapped_);
+  }
+}
+
+int MappedFile::open(const std::string &path, bool streamed) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return 1; // error open file
+
+  struct stat buf;
+  if (fstat(fd, &buf) < 0) {
+    close(fd);
+    return 1;
+  }
+
+  size_ = mapped_ = buf.st_size;
+  if (size_ > 0) {
+    void *addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      size_ = mapped_ = 0;
+      close(fd);
+      return 1;
+    }
+    data_ = static_cast<char *>(addr);
+    madvise(data_, size_, MADV_SEQUENTIAL);
+  }
+  close(fd); // the mapping stays valid after close
+  return opened(path, true, streamed);
+}
+
+int MappedFile::adopt(const std::string &path, char *data, size_t size, size_t mapped) {
+  data_ = data;
+  size_ = size;
+  mapped_ = mapped;
+  return opened(path, false, false);
+}
+
+bool MappedFile::more() {
+  size_t before = size_;
+  while (inflater_ != nullptr && size_ == before) { // a block ending a gzip member may add nothing
+    Inflater &inflater = *inflater_;
+    int ret = inflater.codec == CODEC_GZIP ? inflateGzip(inflater) : inflateZstd(inflater);
+    if (ret != 0 || inflater.finished) {
+      endInflate(ret);
+    } else {
+      // The compressed pages read are not needed again either
+      size_t page = sysconf(_SC_PAGESIZE);
+      size_t consumed = inflater.consumed / page * page;
+      if (consumed > inflater.released) {
+        madvise(const_cast<char *>(inflater.input) + inflater.released, consumed - inflater.released, MADV_DONTNEED);
+        inflater.released = consumed;
+      }
+    }
+  }
+  return size_ > before;
+}
+
+void MappedFile::discard(size_t offset) const {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t length = std::min(offset, size()) / page * page;
+  if (length > 0) {
+    madvise(data_, length, MADV_DONTNEED);
+  }
+}
+
+void MappedFile::sequential(bool enabled) const {
+  if (size() > 0) {
+    madvise(data_, size(), enabled ? MADV_SEQUENTIAL : MADV_RANDOM);
+  }
+}
+
+void MappedFile::drop() {
+  if (path_.empty() && !copied_.empty()) mapCopied();
+  if (!path_.empty()) discard(size_);
+}
+
+void MappedFile::prefetch(size_t offset, size_t length) const {
+  size_t size = this->size();
+  if (offset >= size) return;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t begin = offset / page * page;
+  madvise(data_ + begin, std::min(offset + length, size) - begin, MADV_WILLNEED);
+}
+
+void MappedFile::prefetch(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+  close(fd);
+}
+
+int MappedFile::opened(const std::string &path, bool fileBacked, bool streamed) {
+  Codec codec = codecOfData();
+  if (codec != CODEC_NONE) {
+    int ret = startInflate(path, codec, streamed);
+    if (ret != 0) return ret;
+    if (streamed) {
+      more(); // the first block tells whether the file can be decompressed at all
+    } else {
+      while (more()) {
+      }
+    }
+    return status_;
+  }
+  if (fileBacked) {
+    path_ = path;
+  } else {
+    copied_ = path;
+  }
+  return 0;
+}
+
+void MappedFile::mapCopied() {
+  std::string path = std::move(copied_);
+  copied_.clear();
+  if (size_ == 0) return;
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return;
+  struct stat buf;
+  void *addr = MAP_FAILED;
+  if (fstat(fd, &buf) == 0 && (size_t)buf.st_size == size_) {
+    addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (addr == MAP_FAILED) return;
+  munmap(data_, mapped_);
+  data_ = static_cast<char *>(addr);
+  mapped_ = size_;
+  path_ = path;
+}
+
+Codec MappedFile::codecOfData() const {
+  const unsigned char *magic = reinterpret_cast<const unsigned char *>(data_);
+  if (size_ >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) return CODEC_GZIP;
+  if (size_ >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) return CODEC_ZSTD;
+  return CODEC_NONE;
+}
+
+int MappedFile::startInflate(const std::string &path, Codec codec, bool streamed) {
+  std::unique_ptr<Inflater> inflater(new Inflater());
+  inflater->codec = codec;
+  inflater->path = path;
+  inflater->input = data_;
+  inflater->inputSize = size_;
+  inflater->inputMapped = mapped_;
+  inflater->consumed = 0;
+  inflater->released = 0;
+  inflater->finished = false;
+#ifdef HAVE_ZLIB
+  if (codec == CODEC_GZIP) {
+    memset(&inflater->gzip, 0, sizeof(inflater->gzip));
+    if (inflateInit2(&inflater->gzip, 15 + 32) != Z_OK) return 1; // gzip or zlib header
+    inflater->memberEnded = false;
+  }
+#else
+  if (codec == CODEC_GZIP) {
+    std::cerr << "WARN: built without zlib, cannot read gzip input" << std::endl;
+    return 1;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  inflater->zstd = nullptr;
+  if (codec == CODEC_ZSTD) {
+    inflater->zstd = ZSTD_createDStream();
+    if (inflater->zstd == nullptr) return 1;
+  }
+#else
+  if (codec == CODEC_ZSTD) {
+    std::cerr << "WARN: built without zstd, cannot read zstd input" << std::endl;
+    return 1;
+  }
+#endif
+
+  void *addr = MAP_FAILED;
+  size_t capacity;
+  if (streamed) {
+    // Less when the address space runs short, many inputs are streamed at once
+    size_t floor = std::max<size_t>(inflater->inputSize * 8, 1 << 20);
+    capacity = std::min(std::max(inflater->inputSize * STREAM_RATIO, STREAM_RESERVE), STREAM_RESERVE_MAX);
+    while (addr == MAP_FAILED && capacity >= floor) {
+      addr = mmap(nullptr, capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (addr == MAP_FAILED) capacity /= 2;
+    }
+    inflater->reserved = capacity;
+    inflater->committed = 0;
+  } else {
+    capacity = std::max<size_t>(inflater->inputSize * 8, 1 << 20);
+    addr = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    inflater->reserved = 0;
+    inflater->committed = capacity;
+  }
+  if (addr == MAP_FAILED) {
+    inflater_ = std::move(inflater);
+    data_ = nullptr;
+    mapped_ = 0;
+    endInflate(1);
+    return 1;
+  }
+  data_ = static_cast<char *>(addr);
+  size_ = 0;
+  mapped_ = capacity;
+  inflater_ = std::move(inflater);
+  return 0;
+}
+
+void MappedFile::endInflate(int ret) {
+  Inflater &inflater = *inflater_;
+  if (ret == 2) {
+    std::cerr << "WARN: " << inflater.path << " is corrupt or truncated" << std::endl;
+  }
+#ifdef HAVE_ZLIB
+  if (inflater.codec == CODEC_GZIP) inflateEnd(&inflater.gzip);
+#endif
+#ifdef HAVE_ZSTD
+  if (inflater.zstd != nullptr) ZSTD_freeDStream(inflater.zstd);
+#endif
+  munmap(const_cast<char *>(inflater.input), inflater.inputMapped);
+  inflater_ = nullptr;
+  status_ = ret;
+}
+
+size_t MappedFile::room(Inflater &inflater, size_t wanted) {
+  size_t size = size_;
+  if (size + wanted <= inflater.committed) return wanted;
+  if (inflater.reserved > 0) {
+    if (size == inflater.reserved) {
+      std::cerr << "WARN: " << inflater.path << " decompresses to more than " << inflater.reserved
+                << " bytes, too large to read streamed" << std::endl;
+      return 0;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t larger = std::max(inflater.committed * 2, (size + wanted + page - 1) / page * page);
+    larger = std::min(larger, inflater.reserved);
+    if (mprotect(data_ + inflater.committed, larger - inflater.committed, PROT_READ | PROT_WRITE) != 0) return 0;
+    inflater.committed = larger;
+    return std::min(wanted, larger - size);
+  }
+  size_t larger = std::max(inflater.committed * 2, size + wanted);
+  void *addr = mremap(data_, mapped_, larger, MREMAP_MAYMOVE);
+  if (addr == MAP_FAILED) return 0;
+  data_ = static_cast<char *>(addr);
+  mapped_ = inflater.committed = larger;
+  return wanted;
+}
+
+int MappedFile::inflateGzip(Inflater &inflater) {
+#ifdef HAVE_ZLIB
+  const size_t CHUNK = 1 << 20;
+  size_t avail = room(inflater, CHUNK);
+  if (avail == 0) return 1;
+  z_stream &stream = inflater.gzip;
+  if (inflater.memberEnded) {
+    inflateReset(&stream);
+  }
+  size_t size = size_;
+  stream.next_in = (Bytef *)inflater.input + inflater.consumed;
+  stream.avail_in = std::min<size_t>(inflater.inputSize - inflater.consumed, UINT_MAX);
+  stream.next_out = (Bytef *)data_ + size;
+  stream.avail_out = avail;
+  int ret = inflate(&stream, Z_NO_FLUSH);
+  inflater.consumed = (const char *)stream.next_in - inflater.input;
+  size_ = (char *)stream.next_out - data_;
+  inflater.memberEnded = ret == Z_STREAM_END;
+  if (ret == Z_STREAM_END) {
+    inflater.finished = inflater.consumed == inflater.inputSize;
+    return 0;
+  }
+  if (ret != Z_OK) return 2;
+  return stream.avail_in == 0 && stream.avail_out > 0 ? 2 : 0; // truncated input
+#else
+  (void)inflater;
+  return 1;
+#endif
+}
+
+int MappedFile::inflateZstd(Inflater &inflater) {
+#ifdef HAVE_ZSTD
+  const size_t CHUNK = ZSTD_DStreamOutSize() * 16;
+  size_t avail = room(inflater, CHUNK);
+  if (avail == 0) return 1;
+  ZSTD_inBuffer in = { inflater.input, inflater.inputSize, inflater.consumed };
+  ZSTD_outBuffer out = { data_ + size_, avail, 0 };
+  size_t ret = ZSTD_decompressStream(inflater.zstd, &out, &in);
+  inflater.consumed = in.pos;
+  size_ += out.pos;
+  if (ZSTD_isError(ret)) return 2;
+  if (in.pos == in.size && out.pos < out.size) {
+    // Everything is flushed once the output has room left
+    inflater.finished = true;
+    return ret == 0 ? 0 : 2;
+  }
+  return 0;
+#else
+  (void)inflater;
+  return 1;
+#endif
+}
+
+int CopySource::of(const MappedFile &file) {
+  if (file.path() != path) {
+    if (fd >= 0) close(fd);
+    path = file.path();
+    fd = path.empty() ? -1 : ::open(path.c_str(), O_RDONLY);
+  }
+  return fd;
+}
+
+InputRing::InputRing(const std::vector<std::string> &paths) : paths(paths), inputs(paths.size()) {
+#ifdef HAVE_IO_URING
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ringFd = syscall(__NR_io_uring_setup, ENTRIES, &params);
+  if (ringFd < 0) return; // ENOSYS, or disabled by the kernel or a seccomp policy
+
+  sqLength = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cqLength = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single) sqLength = cqLength = std::max(sqLength, cqLength);
+  sqRing = mmap(nullptr, sqLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+  cqRing = single ? sqRing : mmap(nullptr, cqLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+  sqeLength = params.sq_entries * sizeof(struct io_uring_sqe);
+  void *entries = mmap(nullptr, sqeLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+  if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || entries == MAP_FAILED) {
+    if (entries != MAP_FAILED) munmap(entries, sqeLength);
+    unmapRings();
+    ::close(ringFd);
+    ringFd = -1;
+    return;
+  }
+  char *sq = static_cast<char *>(sqRing), *cq = static_cast<char *>(cqRing);
+  sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+  sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+  sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+  cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+  cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+  cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+  cqes = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+  sqes = static_cast<struct io_uring_sqe *>(entries);
+#endif
+}
+
+InputRing::~InputRing() {
+#ifdef HAVE_IO_URING
+  if (ringFd < 0) return;
+  // The kernel writes into the inputs until their operations complete
+  closing = true;
+  while (running > 0 && reap(true)) {
+  }
+  for (auto &input : inputs) {
+    if (input.fd >= 0) ::close(input.fd);
+    if (input.data != nullptr) munmap(input.data, input.mapped);
+  }
+  munmap(sqes, sqeLength);
+  unmapRings();
+  ::close(ringFd);
+#endif
+}
+
+bool InputRing::available() {
+  std::vector<std::string> none;
+  return bool(InputRing(none));
+}
+
+std::unique_ptr<MappedFile> InputRing::take(size_t i) {
+  std::unique_ptr<MappedFile> file;
+#ifdef HAVE_IO_URING
+  if (ringFd < 0 || i >= inputs.size()) return file;
+  Input &input = inputs[i];
+  while (cursor <= i && !disabled) {
+    start(cursor++);
+  }
+  fill();
+  while (input.stage == Input::OPENING || input.stage == Input::READING) {
+    submit();
+    if (running == 0) {
+      input.pending = 0; // left unsubmitted when the ring was disabled, never completes
+      break;
+    }
+    if (!reap(true)) break;
+    fill();
+  }
+
+  if (input.stage == Input::DONE) {
+    file.reset(new MappedFile());
+    if (file->adopt(paths[i], input.data, input.size, input.mapped) != 0) file.reset();
+    input.data = nullptr;
+  } else if (input.data != nullptr && input.pending == 0) {
+    munmap(input.data, input.mapped);
+    input.data = nullptr;
+  }
+  if (input.fd >= 0 && input.pending == 0) ::close(input.fd);
+  input.fd = -1;
+  if (input.stage != Input::IDLE) waiting--;
+  input.stage = Input::TAKEN;
+  fill();
+  submit();
+#else
+  (void)i;
+#endif
+  return file;
+}
+
+#ifdef HAVE_IO_URING
+void InputRing::unmapRings() {
+  if (cqRing != MAP_FAILED && cqRing != sqRing) munmap(cqRing, cqLength);
+  if (sqRing != MAP_FAILED) munmap(sqRing, sqLength);
+}
+
+void InputRing::fill() {
+  while (cursor < inputs.size() && waiting < DEPTH && !disabled) {
+    start(cursor++);
+  }
+}
+
+void InputRing::start(size_t i) {
+  Input &input = inputs[i];
+  waiting++;
+  input.stage = Input::OPENING;
+  input.pending = 2;
+  struct io_uring_sqe *sqe = push(i, OP_OPEN);
+  sqe->opcode = IORING_OP_OPENAT;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = reinterpret_cast<uint64_t>(paths[i].c_str());
+  sqe->open_flags = O_RDONLY;
+  sqe = push(i, OP_STATX);
+  sqe->opcode = IORING_OP_STATX;
+  sqe->fd = AT_FDCWD;
+  sqe->addr = reinterpret_cast<uint64_t>(paths[i].c_str());
+  sqe->len = STATX_SIZE;
+  sqe->off = reinterpret_cast<uint64_t>(&input.status);
+}
+
+void InputRing::read(size_t i) {
+  Input &input = inputs[i];
+  input.pending = 1;
+  struct io_uring_sqe *sqe = push(i, OP_READ);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = input.fd;
+  sqe->addr = reinterpret_cast<uint64_t>(input.data + input.done);
+  sqe->len = std::min<size_t>(input.size - input.done, 1 << 30);
+  sqe->off = input.done;
+}
+
+struct io_uring_sqe *InputRing::push(size_t i, unsigned op) {
+  if (queued == ENTRIES) submit();
+  unsigned tail = *sqTail + queued;
+  unsigned index = tail & sqMask;
+  struct io_uring_sqe *sqe = &sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->user_data = i * 4 + op;
+  sqArray[index] = index;
+  queued++;
+  return sqe;
+}
+
+void InputRing::submit() {
+  if (queued == 0) return;
+  __atomic_store_n(sqTail, *sqTail + queued, __ATOMIC_RELEASE);
+  unsigned count = queued;
+  queued = 0;
+  while (count > 0) {
+    int ret = syscall(__NR_io_uring_enter, ringFd, count, 0, 0, nullptr, 0);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) {
+      disabled = true; // the entries left are never completed
+      break;
+    }
+    count -= ret;
+    running += ret;
+  }
+}
+
+bool InputRing::reap(bool wait) {
+  unsigned head = *cqHead;
+  if (wait && head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+    int ret = syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (ret < 0 && errno != EINTR) return false;
+  }
+  unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+  for (; head != tail; head++) {
+    const struct io_uring_cqe &cqe = cqes[head & cqMask];
+    complete(cqe.user_data / 4, cqe.user_data % 4, cqe.res);
+    running--;
+  }
+  __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+  return true;
+}
+
+void InputRing::complete(size_t i, unsigned op, int res) {
+  Input &input = inputs[i];
+  input.pending--;
+  if (op == OP_OPEN && res >= 0) {
+    input.fd = res;
+  } else if (op == OP_READ && res > 0) {
+    input.done += res;
+  } else if (op != OP_STATX || res < 0) {
+    if (res == -EINVAL && op == OP_OPEN) disabled = true; // before Linux 5.6
+    input.failed = true; // a read of 0 bytes means the file is shorter than its size
+  }
+  if (input.pending > 0 || closing) return;
+
+  if (input.failed || (input.stage == Input::OPENING && input.status.stx_size > MAX_BYTES)) {
+    input.stage = Input::FAILED;
+    return;
+  }
+  if (input.stage == Input::OPENING) {
+    input.size = input.status.stx_size;
+    if (input.size > 0) {
+      size_t page = sysconf(_SC_PAGESIZE);
+      input.mapped = (input.size + page - 1) / page * page;
+      void *addr = mmap(nullptr, input.mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+      if (addr == MAP_FAILED) {
+        input.stage = Input::FAILED;
+        return;
+      }
+      input.data = static_cast<char *>(addr);
+    }
+    input.stage = Input::READING;
+  }
+  if (input.done < input.size) {
+    read(i);
+  } else {
+    input.stage = Input::DONE;
+  }
+}
+
+#endif
+
+OutputFile::OutputFile(const std::string &path, bool append)
+      : fd(-1), used(0), written(0), good(true), buffer(new char[BUFFER_SIZE]), codec(codecOfPath(path)) {
+  fd = ::open(path.c_str(), O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0666);
+  good = fd >= 0 && startCodec();
+  if (good && append) fileBytes = writtenBack = std::max<off_t>(0, lseek(fd, 0, SEEK_END));
+}
+
+OutputFile &OutputFile::write(const char *data, size_t length) {
+  if (!good) return *this;
+
+  if (length <= BUFFER_SIZE - used) {
+    memcpy(buffer.get() + used, data, length);
+    used += length;
+  } else if (length < DIRECT_SIZE) {
+    flush();
+    memcpy(buffer.get(), data, length);
+    used = length;
+  } else {
+    // Write the pending buffer and the block together, without copying the block
+    struct iovec iov[2] = {{buffer.get(), used}, {const_cast<char *>(data), length}};
+    writeAll(iov, 2);
+    used = 0;
+  }
+  return *this;
+}
+
+OutputFile &OutputFile::copy(int in, uint64_t offset, const char *data, size_t length) {
+  if (!good || in < 0 || !copying || codec != CODEC_NONE) {
+    return write(data, length);
+  }
+
+  flush();
+  size_t done = 0;
+  while (good && done < length) {
+    loff_t from = offset + done;
+    ssize_t n = copy_file_range(in, &from, fd, nullptr, length - done, 0);
+    if (n > 0) {
+      done += n;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else {
+      // Not supported between these files (pipe, O_APPEND, other file system...)
+      copying = false;
+      break;
+    }
+  }
+  written += done;
+  wroteOut(done);
+  if (done < length) write(data + done, length - done);
+  return *this;
+}
+
+void OutputFile::flush() {
+  if (!good || used == 0) return;
+  struct iovec iov = {buffer.get(), used};
+  writeAll(&iov, 1);
+  used = 0;
+}
+
+void OutputFile::close(bool sync) {
+  if (fd < 0) return;
+  flush();
+  endCodec();
+  if (sync && good && fsync(fd) < 0 && errno != EINVAL) good = false;
+  if (::close(fd) < 0) good = false;
+  fd = -1;
+}
+
+bool OutputFile::startCodec() {
+  if (codec == CODEC_NONE) return true;
+  packed.reset(new char[BUFFER_SIZE]);
+#ifdef HAVE_ZLIB
+  if (codec == CODEC_GZIP) {
+    memset(&gzip, 0, sizeof(gzip));
+    if (deflateInit2(&gzip, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK) return true;
+    codec = CODEC_NONE;
+    return false;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (codec == CODEC_ZSTD) {
+    zstd = ZSTD_createCStream();
+    if (zstd != nullptr) return true;
+    codec = CODEC_NONE;
+    return false;
+  }
+#endif
+  std::cerr << "WARN: built without " << (codec == CODEC_GZIP ? "zlib" : "zstd")
+            << ", cannot write compressed output" << std::endl;
+  codec = CODEC_NONE;
+  return false;
+}
+
+void OutputFile::endCodec() {
+#ifdef HAVE_ZLIB
+  if (codec == CODEC_GZIP) {
+    compress(nullptr, 0, true);
+    deflateEnd(&gzip);
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (codec == CODEC_ZSTD) {
+    compress(nullptr, 0, true);
+    ZSTD_freeCStream(zstd);
+    zstd = nullptr;
+  }
+#endif
+  codec = CODEC_NONE;
+}
+
+void OutputFile::compress(const char *data, size_t length, bool finish) {
+#ifdef HAVE_ZLIB
+  if (codec == CODEC_GZIP) {
+    gzip.next_in = (Bytef *)data;
+    gzip.avail_in = length;
+    int ret;
+    do {
+      gzip.next_out = (Bytef *)packed.get();
+      gzip.avail_out = BUFFER_SIZE;
+      ret = deflate(&gzip, finish ? Z_FINISH : Z_NO_FLUSH);
+      writeRaw(packed.get(), BUFFER_SIZE - gzip.avail_out);
+    } while (good && ret != Z_STREAM_ERROR && (gzip.avail_out == 0 || (finish && ret != Z_STREAM_END)));
+    if (ret == Z_STREAM_ERROR) good = false;
+  }
+#endif
+#ifdef HAVE_ZSTD
+  if (codec == CODEC_ZSTD) {
+    ZSTD_inBuffer in = { data, length, 0 };
+    size_t remaining;
+    do {
+      ZSTD_outBuffer out = { packed.get(), BUFFER_SIZE, 0 };
+      remaining = ZSTD_compressStream2(zstd, &out, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+      if (ZSTD_isError(remaining)) {
+        good = false;
+        break;
+      }
+      writeRaw(packed.get(), out.pos);
+    } while (good && (finish ? remaining > 0 : in.pos < in.size));
+  }
+#endif
+  (void)data, (void)length, (void)finish;
+}
+
+void OutputFile::writeRaw(const char *data, size_t length) {
+  struct iovec iov = {const_cast<char *>(data), length};
+  writeVector(&iov, 1);
+}
+
+void OutputFile::writeAll(struct iovec *iov, int count) {
+  for (int i = 0; i < count; i++) {
+    written += iov[i].iov_len;
+  }
+  if (codec == CODEC_NONE) {
+    writeVector(iov, count);
+    return;
+  }
+  for (int i = 0; i < count && good; i++) {
+    compress(static_cast<const char *>(iov[i].iov_base), iov[i].iov_len, false);
+  }
+}
+
+void OutputFile::wroteOut(size_t length) {
+  fileBytes += length;
+  if (fileBytes - writtenBack >= WRITEBACK_SIZE) {
+    sync_file_range(fd, writtenBack, fileBytes - writtenBack, SYNC_FILE_RANGE_WRITE);
+    writtenBack = fileBytes;
+  }
+}
+
+void OutputFile::writeVector(struct iovec *iov, int count) {
+  while (good && count > 0) {
+    ssize_t n = writev(fd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      good = false;
+      break;
+    }
+    wroteOut(n);
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+      iov->iov_len -= n;
+    }
+  }
+}
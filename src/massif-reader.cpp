@@ -0,0 +1,540 @@
+// libmassif-combine: the heap tree scanners, the snapshot parser and its read ahead
+// stage, see massif-internal.h
+#include "massif-internal.h"
+
+size_t scanTreeScalar(const char *data, size_t offset, size_t size, uint64_t &lines) {
+  while (offset < size && !isTreeEnd(data[offset])) {
+    const char *eol = static_cast<const char *>(memchr(data + offset, '\n', size - offset));
+    offset = eol == nullptr ? size : eol - data + 1;
+    lines++;
+  }
+  return offset;
+}
+
+#if defined(__x86_64__)
+// End a vector scan: stop holds the newlines of the block at i followed by a tree end,
+// newlines all of them; returns true with offset set when the tree ends in the block
+static inline bool stopTreeScan(uint64_t newlines, uint64_t stop, size_t i, size_t &offset, uint64_t &lines,
+                                int (*popcount)(uint64_t)) {
+  if (stop == 0) {
+    lines += popcount(newlines);
+    return false;
+  }
+  int bit = __builtin_ctzll(stop);
+  lines += popcount(newlines & (((uint64_t)2 << bit) - 1)); // wraps to all bits for bit 63
+  offset = i + bit + 1;
+  return true;
+}
+
+// Finish a vector scan stopped at the block boundary i, which may be inside a line
+static size_t finishTreeScan(const char *data, size_t offset, size_t i, size_t size, uint64_t &lines) {
+  if (i > offset && data[i - 1] != '\n') {
+    const char *eol = static_cast<const char *>(memchr(data + i, '\n', size - i));
+    lines++;
+    if (eol == nullptr) return size;
+    i = eol - data + 1;
+  }
+  return scanTreeScalar(data, i, size, lines);
+}
+
+// Newlines are sparse in a tree, one per line of about 60 bytes: find them 64 bytes at
+// a time and test the byte after each one, comparing every byte with the six tree ends
+// costs more than the memchr of the scalar scan
+size_t scanTreeSse2(const char *data, size_t offset, size_t size, uint64_t &lines) {
+  if (offset >= size || isTreeEnd(data[offset])) return offset;
+  const __m128i newline = _mm_set1_epi8('\n');
+  size_t i = offset;
+  for (; i + 65 <= size; i += 64) {
+    uint64_t newlines = 0;
+    for (int block = 0; block < 4; block++) {
+      __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + 16 * block));
+      newlines |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)) << (16 * block);
+    }
+    for (; newlines != 0; newlines &= newlines - 1) {
+      size_t next = i + __builtin_ctzll(newlines) + 1;
+      lines++;
+      if (isTreeEnd(data[next])) return next;
+    }
+  }
+  return finishTreeScan(data, offset, i, size, lines);
+}
+
+__attribute__((target("popcnt")))
+static int popcountAvx2(uint64_t mask) { return __builtin_popcountll(mask); }
+
+// Mask of the bytes of next that are a tree end: two nibble lookups whose bits meet
+// only for '#' (0x23), 'c', 'd', 'h', 'm' (0x63, 0x64, 0x68, 0x6d) and 't' (0x74)
+__attribute__((target("avx2")))
+static inline uint32_t treeEndsAvx2(__m256i next) {
+  const __m256i low = _mm256_setr_epi8(0, 0, 0, 3, 6, 0, 0, 0, 2, 0, 0, 0, 0, 2, 0, 0,
+                                       0, 0, 0, 3, 6, 0, 0, 0, 2, 0, 0, 0, 0, 2, 0, 0);
+  const __m256i high = _mm256_setr_epi8(0, 0, 1, 0, 0, 0, 2, 4, 0, 0, 0, 0, 0, 0, 0, 0,
+                                        0, 0, 1, 0, 0, 0, 2, 4, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i bits = _mm256_and_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(next, nibble)),
+                                  _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(next, 4), nibble)));
+  return ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(bits, _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx2,popcnt")))
+size_t scanTreeAvx2(const char *data, size_t offset, size_t size, uint64_t &lines) {
+  if (offset >= size || isTreeEnd(data[offset])) return offset;
+  const __m256i newline = _mm256_set1_epi8('\n');
+  size_t i = offset;
+  for (; i + 65 <= size; i += 64) {
+    __m256i block0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+    __m256i block1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 32));
+    uint64_t newlines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block0, newline))
+                      | (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block1, newline)) << 32;
+    uint64_t stop = treeEndsAvx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 1)))
+                  | (uint64_t)treeEndsAvx2(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + 33))) << 32;
+    if (stopTreeScan(newlines, newlines & stop, i, offset, lines, popcountAvx2)) return offset;
+  }
+  return finishTreeScan(data, offset, i, size, lines);
+}
+#endif
+
+TreeScan selectTreeScan(const char **name) {
+  const char *wanted = getenv("MASSIF_SCAN");
+  std::string choice = wanted ? wanted : "";
+  TreeScan scan = scanTreeScalar;
+  const char *picked = "scalar";
+#if defined(__x86_64__)
+  if (choice.empty() || choice == "avx2") {
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+      scan = scanTreeAvx2;
+      picked = "avx2";
+    } else {
+      scan = scanTreeSse2;
+      picked = "sse2";
+    }
+  } else if (choice == "sse2") {
+    scan = scanTreeSse2; // part of x86-64
+    picked = "sse2";
+  }
+#endif
+  if (name != nullptr) *name = picked;
+  return scan;
+}
+
+const TreeScan scanTree = selectTreeScan();
+
+int SnapshotReader::open(const std::string &path, bool keep_header, bool hash_body) {
+  file.reset(new MappedFile());
+  if (file->open(path, true) != 0) {
+    file = nullptr;
+    mapped = nullptr;
+    return 1; // error open file
+  }
+
+  openRange(*file, 0, file->complete() ? file->size() : SIZE_MAX, keep_header, hash_body);
+  stats.files = 1;
+  stats.chunks = 1;
+  stats.bytes = file->size();
+  return 0;
+}
+
+void SnapshotReader::openRange(const MappedFile &source, size_t begin, size_t end, bool keep_header, bool hash_body) {
+  mapped = &source;
+  this->keep_header = keep_header;
+  this->hash_body = hash_body;
+  stats = Stats();
+  status = begin == 0 ? LastLine::NONE : LastLine::SNAPSHOT_CONTENT;
+  cursor = begin;
+  limit = end;
+  count = 0;
+  error = 0;
+  reading = false;
+  base = 0;
+  if (begin > 0 && begin < end) {
+    // Numbered from the name line of the first snapshot, the caller checks it is right
+    const char *eol = static_cast<const char *>(memchr(source.data() + begin, '\n', end - begin));
+    size_t name = eol == nullptr ? end : eol - source.data() + 1;
+    if (startsWithNumber(source.data() + name, end - name, "snapshot=")) {
+      base = parseNumber(source.data() + name + 9, end - name - 9);
+    }
+  }
+}
+
+bool SnapshotReader::next(Snapshot &snapshot) {
+  if (mapped == nullptr || error != 0) return false;
+
+  const char *data = mapped->data();
+  for (;;) {
+    const char *end = data + std::min(limit, mapped->size());
+    if (data + cursor >= end) {
+      if (grow()) continue;
+      break;
+    }
+    const char *str = data + cursor;
+    const char *eol = static_cast<const char *>(memchr(str, '\n', end - str));
+    if (eol == nullptr) {
+      if (grow()) continue; // the line goes on in the part not decompressed yet
+      if (error != 0) return false;
+      eol = end;
+    }
+    size_t len = eol - str;
+    cursor = std::min(eol + 1, end) - data;
+
+    if (isKeywordLine(str, len)) {
+      status = LastLine::HEADER;
+      stats.headerLines++;
+      if (keep_header) {
+        headers.push_back(std::string(str, len));
+      }
+
+      continue;
+    }
+
+    if ((status == LastLine::HEADER || status == LastLine::SNAPSHOT_CONTENT) && isSnapshotMark(str, len)) {
+      status = LastLine::SNAPSHOT_MARK;
+      stats.markLines++;
+      if (finish(snapshot)) return true;
+      continue;
+    }
+
+    if (status == LastLine::SNAPSHOT_MARK && startsWithNumber(str, len, "snapshot=")) {
+      status = LastLine::SNAPSHOT_NAME;
+      stats.nameLines++;
+      continue;
+    }
+
+    if (status == LastLine::SNAPSHOT_NAME && isSnapshotMark(str, len)) {
+      status = LastLine::SNAPSHOT_CONTENT;
+      stats.markLines++;
+      if (!reading) {
+        reading = true;
+        current.time = 0;
+        current.memHeap = 0;
+        current.memHeapExtra = 0;
+        current.memStacks = 0;
+        current.heapTree = HEAP_TREE_NONE;
+        current.offset = cursor;
+        current.length = 0;
+        current.source = 0;
+        current.index = count++;
+        current.hash = 0;
+        current.flags = isTitled(cursor, base + current.index) ? SNAPSHOT_TITLED : 0;
+      } else {
+        std::cerr << "WARN: found new snapshot but existing another snapshot" << std::endl;
+        stats.dropped++;
+        error = 2; // error when handling file
+        return false;
+      }
+      continue;
+    }
+
+    if (status == LastLine::SNAPSHOT_CONTENT) {
+      if (!reading) {
+        std::cerr << "WARN: snapshot should not empty now" << std::endl;
+        error = 2; // error when handling file
+        return false;
+      } else {
+        stats.contentLines++;
+        if (parseField(str, len)) {
+          cursor = skipTree(cursor);
+        }
+        current.length = cursor - current.offset;
+      }
+      continue;
+    }
+
+    stats.otherLines++;
+  }
+
+  // Last snapshot ends with the file, unless its decompression failed
+  return error == 0 && finish(snapshot);
+}
+
+size_t SnapshotReader::findLastSnapshot(const MappedFile &file, uint64_t &time) {
+  const char *data = file.data();
+  size_t lineEnd = file.size();
+  if (lineEnd > 0 && data[lineEnd - 1] == '\n') lineEnd--;
+
+  bool timeSeen = false, markSeen = false;
+  time = 0;
+  if (data == nullptr) return 0;
+  for (;;) {
+    const char *eol = static_cast<const char *>(memrchr(data, '\n', lineEnd));
+    size_t lineStart = eol == nullptr ? 0 : eol - data + 1;
+    const char *str = data + lineStart;
+    size_t len = lineEnd - lineStart;
+
+    if (markSeen && startsWithNumber(str, len, "snapshot=")) {
+      return parseNumber(str + 9, len - 9) + 1;
+    }
+    // The last time= of the body wins, like when reading forward
+    if (!timeSeen && startsWithNumber(str, len, "time=")) {
+      time = parseNumber(str + 5, len - 5);
+      timeSeen = true;
+    }
+    markSeen = isSnapshotMark(str, len);
+
+    if (lineStart == 0) break;
+    lineEnd = lineStart - 1;
+  }
+  return 0;
+}
+
+bool SnapshotReader::missesWindow(const MappedFile &file, const SnapshotFilter &filter) {
+  if (!filter.hasWindow() || !file.complete()) return false; // a streamed file has no end yet
+
+  uint64_t last;
+  if (findLastSnapshot(file, last) == 0) return false;
+  const char *data = file.data();
+  const char *found = static_cast<const char *>(memmem(data, file.size(), "\ntime=", 6));
+  if (found == nullptr) return false;
+  uint64_t first = parseNumber(found + 6, data + file.size() - found - 6);
+  return first <= last && (last < filter.from || first > filter.to);
+}
+
+size_t SnapshotReader::findSnapshotStart(const MappedFile &file, size_t from) {
+  static const char pattern[] = "\n#-----------\nsnapshot=";
+  const char *data = file.data();
+  size_t size = file.size();
+  while (from < size) {
+    const char *found = static_cast<const char *>(memmem(data + from, size - from, pattern, sizeof(pattern) - 1));
+    if (found == nullptr) break;
+
+    size_t start = found - data + 1;
+    const char *name = found + 14;
+    const char *eol = static_cast<const char *>(memchr(name, '\n', data + size - name));
+    if (eol != nullptr && startsWithNumber(name, eol - name, "snapshot=")) {
+      const char *mark = eol + 1;
+      const char *markEnd = static_cast<const char *>(memchr(mark, '\n', data + size - mark));
+      if (markEnd == nullptr) markEnd = data + size;
+      if (isSnapshotMark(mark, markEnd - mark)) return start;
+    }
+    from = start;
+  }
+  return size;
+}
+
+bool SnapshotReader::finish(Snapshot &snapshot) {
+  if (!reading) return false;
+
+  reading = false;
+  if (current.length == 0) {
+    stats.dropped++;
+    return false;
+  }
+  if (!filter.accepts(current)) {
+    stats.filtered++;
+    return false;
+  }
+  stats.kept++;
+  if (mapped->data()[current.offset + current.length - 1] == '\n') {
+    current.flags |= SNAPSHOT_NEWLINE;
+  }
+  if (hash_body) {
+    // Hashed while the body is still in cache
+    const char *body = mapped->data() + current.offset;
+    current.hash = (uint32_t)hashBytes(body, bodyLength(body, current.length));
+  }
+  snapshot = current;
+  return true;
+}
+
+bool SnapshotReader::isTitled(size_t offset, size_t index) const {
+  char title[64];
+  size_t len = formatTitle(title, index);
+  const char *data = mapped->data();
+  return offset >= len && memcmp(data + offset - len, title, len) == 0 && (offset == len || data[offset - len - 1] == '\n');
+}
+
+bool SnapshotReader::parseField(const char *str, size_t len) {
+  if (len == 0) return false;
+  switch (str[0]) {
+  case 't':
+    if (startsWithNumber(str, len, "time=")) {
+      current.time = parseNumber(str + 5, len - 5);
+    }
+    break;
+  case 'm':
+    if (startsWithNumber(str, len, "mem_heap_B=")) {
+      current.memHeap = parseNumber(str + 11, len - 11);
+    } else if (startsWithNumber(str, len, "mem_heap_extra_B=")) {
+      current.memHeapExtra = parseNumber(str + 17, len - 17);
+    } else if (startsWithNumber(str, len, "mem_stacks_B=")) {
+      current.memStacks = parseNumber(str + 13, len - 13);
+    }
+    break;
+  case 'h':
+    if (startsWith(str, len, "heap_tree=")) {
+      str += 10;
+      len -= 10;
+      current.heapTree = startsWith(str, len, "peak") ? HEAP_TREE_PEAK
+                       : startsWith(str, len, "detailed") ? HEAP_TREE_DETAILED
+                       : startsWith(str, len, "empty") ? HEAP_TREE_EMPTY : HEAP_TREE_NONE;
+      return true;
+    }
+    break;
+  }
+  return false;
+}
+
+size_t SnapshotReader::skipTree(size_t offset) {
+  const char *data = mapped->data();
+  // Up to the last whole line decompressed yet, the scan goes on from there
+  while (file != nullptr && !file->complete()) {
+    size_t size = std::min(limit, mapped->size());
+    const char *last = offset < size ? static_cast<const char *>(memrchr(data + offset, '\n', size - offset)) : nullptr;
+    size_t end = last == nullptr ? offset : last - data + 1;
+    offset = scanTree(data, offset, end, stats.contentLines);
+    if (offset < end) return offset;
+    grow();
+  }
+  return scanTree(data, offset, std::min(limit, mapped->size()), stats.contentLines);
+}
+
+bool SnapshotReader::grow() {
+  if (file == nullptr || file->complete()) return false;
+  bool grown = file->more();
+  stats.bytes = file->size();
+  if (file->result() != 0) error = file->result();
+  return grown && error == 0;
+}
+
+uint64_t SnapshotReader::parseNumber(const char *str, size_t len) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < len && isdigit((unsigned char)str[i]); i++) {
+    uint64_t digit = str[i] - '0';
+    if (value > (UINT64_MAX - digit) / 10) return UINT64_MAX;
+    value = value * 10 + digit;
+  }
+  return value;
+}
+
+bool SnapshotReader::isKeywordLine(const char *line, size_t len) {
+  if (len == 0) return false;
+  switch (line[0]) {
+  case 'd': return startsWith(line, len, "desc:");
+  case 'c': return startsWith(line, len, "cmd:");
+  case 't': return startsWith(line, len, "time_unit:");
+  default: return false;
+  }
+}
+
+bool SnapshotReader::isSnapshotMark(const char *line, size_t len) {
+  static const char mark[] = "#-----------";
+  return len == sizeof(mark) - 1 && memcmp(line, mark, len) == 0;
+}
+
+ReadAhead::ReadAhead(const std::vector<std::string> &paths, unsigned jobs, const SnapshotFilter &filter)
+      : paths(paths), filter(filter), lanes(paths.size()), ahead(0), stopping(false) {
+  if (jobs <= 1) return; // parsed by next() on the merge thread
+
+  for (size_t i = 0; i < paths.size(); i++) {
+    wanted.push(i); // opened in argument order
+  }
+  for (unsigned i = 0; i < jobs && i < paths.size(); i++) {
+    threads.emplace_back([this]() { work(); });
+  }
+}
+
+ReadAhead::~ReadAhead() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  workCv.notify_all();
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+bool ReadAhead::next(size_t input, Snapshot &snapshot) {
+  Lane &lane = lanes[input];
+  if (lane.next == lane.taken.size() && threads.empty()) {
+    if (lane.finished) return false;
+
+    Clock::time_point start = Clock::now();
+    lane.taken.clear();
+    lane.next = 0;
+    lane.finished = fill(input, lane, lane.taken);
+    parseNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+    if (lane.taken.empty()) return false;
+  } else if (lane.next == lane.taken.size()) {
+    if (lane.finished) return false;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    readyCv.wait(lock, [&]() { return lane.filled; });
+    lane.taken.swap(lane.ready);
+    lane.ready.clear();
+    lane.next = 0;
+    lane.filled = false;
+    lane.finished = lane.done;
+    if (!lane.finished) {
+      wanted.push(input);
+      workCv.notify_one();
+    }
+    if (lane.taken.empty()) return false;
+  }
+  snapshot = lane.taken[lane.next++];
+  ahead -= snapshot.length;
+  return true;
+}
+
+void ReadAhead::work() {
+  std::vector<Snapshot> batch;
+  while (true) {
+    size_t input;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      workCv.wait(lock, [&]() { return stopping || !wanted.empty(); });
+      if (stopping) return;
+      input = wanted.front();
+      wanted.pop();
+    }
+
+    Clock::time_point start = Clock::now();
+    Lane &lane = lanes[input];
+    bool done = fill(input, lane, batch);
+    parseNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      lane.ready.swap(batch);
+      lane.filled = true;
+      lane.done = done;
+    }
+    readyCv.notify_all();
+    batch.clear();
+  }
+}
+
+bool ReadAhead::fill(size_t input, Lane &lane, std::vector<Snapshot> &batch) {
+  if (lane.reader == nullptr) {
+    lane.reader.reset(new SnapshotReader());
+    if (lane.reader->open(paths[input]) != 0) {
+      std::cerr << "WARN: cannot open " << paths[input] << std::endl;
+      lane.reader = nullptr;
+      return true;
+    }
+    if (SnapshotReader::missesWindow(lane.reader->source(), filter)) {
+      lane.reader->stats.skipped++; // no snapshot of the input can pass, keep it unread
+      return true;
+    }
+    lane.reader->setFilter(filter);
+  }
+
+  size_t used = ahead, bytes = 0;
+  size_t limit = used < BUDGET_BYTES ? std::min(LANE_BYTES, BUDGET_BYTES - used) : 0;
+  Snapshot snapshot;
+  bool done = false;
+  while (batch.size() < BATCH_SIZE && bytes <= limit) {
+    if (!lane.reader->next(snapshot)) {
+      done = true;
+      break;
+    }
+    batch.push_back(snapshot);
+    bytes += snapshot.length;
+  }
+  ahead += bytes;
+
+  // The next request comes once the merge takes this batch, read it meanwhile
+  if (!done && limit > 0) {
+    lane.reader->source().prefetch(snapshot.offset + snapshot.length, limit);
+  }
+  return done;
+}
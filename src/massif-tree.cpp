@@ -0,0 +1,115 @@
+// libmassif-combine: heap tree parsing and merging, see massif-internal.h
+#include "massif-internal.h"
+
+uint32_t StringTable::intern(const char *str, size_t len) {
+  auto found = ids.emplace(std::string(str, len), (uint32_t)strings.size());
+  if (found.second) {
+    strings.push_back(&found.first->first);
+  }
+  return found.first->second;
+}
+
+void parseHeapTree(const char *body, size_t length, StringTable &table, std::vector<TreeNode> &tree) {
+  tree.clear();
+  const char *end = body + length;
+  bool inTree = false;
+  for (const char *str = body; str < end; ) {
+    const char *eol = static_cast<const char *>(memchr(str, '\n', end - str));
+    if (eol == nullptr) eol = end;
+    const char *line = str;
+    str = eol + 1;
+
+    if (!inTree) {
+      inTree = eol - line >= 10 && memcmp(line, "heap_tree=", 10) == 0;
+      continue;
+    }
+
+    const char *p = line;
+    while (p < eol && *p == ' ') p++;
+    if (p == eol || *p++ != 'n' || p == eol || !isdigit((unsigned char)*p)) break;
+
+    TreeNode node = { 0, 0, 0 };
+    for (; p < eol && isdigit((unsigned char)*p); p++) node.children = node.children * 10 + (*p - '0');
+    if (eol - p < 3 || p[0] != ':' || p[1] != ' ') break;
+    for (p += 2; p < eol && isdigit((unsigned char)*p); p++) node.bytes = node.bytes * 10 + (*p - '0');
+    if (p < eol && *p == ' ') p++;
+
+    size_t len = eol - p;
+    if (len > 0 && p[len - 1] == '\r') len--;
+    node.symbol = table.intern(p, len);
+    tree.push_back(node);
+  }
+}
+
+void MergedTree::add(const std::vector<TreeNode> &tree, int64_t sign) {
+  std::vector<std::pair<uint32_t, uint32_t>> stack; // merged node, children left to read
+  for (auto &node : tree) {
+    uint32_t parent = stack.empty() ? 0 : stack.back().first;
+    uint32_t id = child(parent, node.symbol);
+    nodes[id].bytes += sign * (int64_t)node.bytes;
+
+    if (!stack.empty()) stack.back().second--;
+    if (node.children > 0) stack.push_back(std::make_pair(id, node.children));
+    while (!stack.empty() && stack.back().second == 0) stack.pop_back();
+  }
+}
+
+int64_t MergedTree::total() const {
+  std::vector<std::vector<uint32_t>> children;
+  std::vector<int64_t> sizes;
+  layout(children, sizes);
+  return sizes[0];
+}
+
+void MergedTree::write(OutputFile &file, const StringTable &table) const {
+  std::vector<std::vector<uint32_t>> children;
+  std::vector<int64_t> sizes;
+  layout(children, sizes);
+  writeNode(file, table, children, sizes, 0, 0);
+}
+
+uint32_t MergedTree::child(uint32_t parent, uint32_t symbol) {
+  auto found = index.emplace(((uint64_t)parent << 32) | symbol, (uint32_t)nodes.size());
+  if (found.second) {
+    nodes.push_back(Node{0, symbol, parent});
+  }
+  return found.first->second;
+}
+
+void MergedTree::layout(std::vector<std::vector<uint32_t>> &children, std::vector<int64_t> &sizes) const {
+  // Nodes are created after their parent, so one reverse pass fills the children lists
+  // and sizes a node from the sum of its children before its parent is reached
+  children.assign(nodes.size(), std::vector<uint32_t>());
+  sizes.assign(nodes.size(), 0);
+  std::vector<bool> used(nodes.size(), false);
+  for (size_t id = nodes.size() - 1; id > 0; id--) {
+    if (used[id] || nodes[id].bytes != 0) {
+      uint32_t parent = nodes[id].parent;
+      used[id] = used[parent] = true;
+      children[parent].push_back(id);
+      sizes[id] = std::max(sizes[id], nodes[id].bytes);
+      sizes[parent] += sizes[id];
+    }
+  }
+  for (auto &list : children) {
+    std::sort(list.begin(), list.end(), [this](uint32_t a, uint32_t b) {
+      int64_t x = std::abs(nodes[a].bytes), y = std::abs(nodes[b].bytes);
+      return x != y ? x > y : a < b;
+    });
+  }
+}
+
+void MergedTree::writeNode(OutputFile &file, const StringTable &table, const std::vector<std::vector<uint32_t>> &children,
+                           const std::vector<int64_t> &sizes, uint32_t id, size_t depth) const {
+  for (uint32_t c : children[id]) {
+    char line[64];
+    int len = snprintf(line, sizeof(line), "%*sn%zu: %lld ", (int)depth, "", children[c].size(), (long long)sizes[c]);
+    file.write(line, len).write(table.get(nodes[c].symbol));
+    if (sizes[c] != nodes[c].bytes) {
+      len = snprintf(line, sizeof(line), " [delta %lld B]", (long long)nodes[c].bytes);
+      file.write(line, len);
+    }
+    file.put('\n');
+    writeNode(file, table, children, sizes, c, depth + 1);
+  }
+}